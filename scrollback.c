@@ -5,7 +5,6 @@
  *
  * tbd: option for the scroll control strings: scrollup, scrolldown
  * tbd: option for the scrollup/scrolldown keycodes: keycodeup, keycodedown
- * tbd: colors
  * tbd: implement common cursor movements instead of asking the position
  */
 
@@ -28,18 +27,18 @@
  *
  * void parent(int master, pid_t pid);
  *	the main loop; calls exchange() repeatedly to pass data between the
- *	terminal and the shell in both directions with no timeout
+ *	terminal and the shell in both directions
  *
- * int exchange(int master, int readshell, struct timeval *timeout);
- *	process a single data block from the terminal or the shell; parameters
- *	readshell and timeout tell whether to read from the shell and whether
- *	to timeout reading; data from the terminal is forwarded to the shell
- *	except the cursor position answers
+ * int exchange(int master, int readshell);
+ *	wait for events and process a single data block from the terminal or
+ *	the shell; parameter readshell tells whether to read from the shell;
+ *	data from the terminal is forwarded to the shell except the cursor
+ *	position answers
  *
  * void knowposition(int master, int alreadyasked);
  *	called whenever the cursor position is needed; ask the terminal and
  *	wait for an answer; the latter is done by calling exchange() to only
- *	receive data from the terminal with a timeout
+ *	receive data from the terminal until the answer or a timeout
  *
  * int positionstatus
  *	whether the cursor position is known
@@ -68,6 +67,329 @@
  * at the start of the next
  */
 
+/*
+ * output floods
+ * -------------
+ *
+ * a program printing a lot of text (yes, find /, cat on a large file) makes
+ * the shell wait for the console, which scrolls much slower than the
+ * pseudoterminal; with -r, when more than FLOODTHRESHOLD bytes are waiting to
+ * be read from the shell, scrollback stops forwarding the characters to the
+ * terminal and only stores them in the scrollback buffer; the screen region of
+ * the buffer is then drawn at most framerate times per second
+ *
+ * void enterflood(int kind);
+ *	start dropping output; the copy of what the terminal is showing is
+ *	taken from the buffer, or marked as unknown after an interrupt
+ *
+ * void frame();
+ *	bring the terminal up to date with the buffer; the rows scrolled since
+ *	the last frame are scrolled by newlines, then only the characters that
+ *	differ from the shadow copy are printed
+ *
+ * void leaveflood();
+ *	draw the last frame and return forwarding characters as usual
+ *
+ * the same is done when the interrupt character of the pseudoterminal (usually
+ * ctrl-C) is typed while the shell is flooding, but without drawing frames:
+ * the output still waiting to be read is only stored in the buffer, and the
+ * terminal jumps to the final screen when it is all read
+ *
+ * the cursor position is tracked while flooding, like when forwarding; since
+ * the terminal is not asked, anything that makes it unknown ends the flood;
+ * the exceptions are the sequences that do not move the cursor: attributes are
+ * sent to the terminal when the flood ends, erasing to end of line is done in
+ * the buffer
+ */
+
+/*
+ * event loop
+ * ----------
+ *
+ * exchange() waits with epoll on the terminal, the shell, the output queue
+ * becoming writable, a signalfd and two timerfds:
+ *
+ * - the signalfd receives SIGCHLD, SIGWINCH, SIGTERM, SIGUSR1 and SIGUSR2,
+ *   which are blocked; when the shell terminates, its remaining output is
+ *   processed and then exchange() returns -1; SIGTERM makes it return -1
+ *   immediately
+ *
+ * - querytimer expires when the terminal takes too much to answer a cursor
+ *   position query, flushtimer when the end of synchronized output does not
+ *   arrive in time
+ *
+ * the file descriptors are registered with watch(), which only calls
+ * epoll_ctl() when the events to wait for change; the shell is not watched
+ * when not to be read
+ *
+ * with option -i, exchangeuring() is used instead: the read from the shell
+ * into a registered buffer, the write of the output queue
+ * and a poll on the epoll file descriptor are submitted together to an
+ * io_uring and waited for with a single io_uring_enter(); each read stays
+ * submitted until its data is processed; the output queue is swapped with a
+ * second buffer that is written in chunks while the first is filled again;
+ * the signalfd and the timers are still in the epoll set, which only tells
+ * when to call epoll_wait() without waiting
+ */
+
+/*
+ * input thread
+ * ------------
+ *
+ * the terminal is read by a separate thread, inputloop(), so that keys reach
+ * the shell while the main thread is writing output or waiting for the
+ * cursor position; it writes the keys to the shell directly, except:
+ *
+ * - the scrolling keys and the answers to position queries
+ * - everything while scrolled back, or while the main thread has not yet
+ *   processed what was passed to it, so that the keys stay in order
+ *
+ * these are passed to the main thread through a single-producer,
+ * single-consumer ring, and inputevent (an eventfd in the epoll set) is
+ * signaled; the main thread processes them with terminaltoshell() as before
+ *
+ * the main thread publishes scrolled and inputtail after processing; the
+ * input thread only reads them; inputpause() and inputresume() stop reading
+ * the terminal while another program runs on it
+ */
+
+/*
+ * recorder thread
+ * ---------------
+ *
+ * the main thread parses the output of the shell only as far as needed for
+ * forwarding it: escape sequences, the cursor position and the utf8
+ * characters; the changes to the scrollback buffer are appended as records
+ * to a single-producer, single-consumer ring: a character in a cell, or a
+ * range of cells to blank; recorderloop() applies them in another thread
+ *
+ * the records are only made visible to the recorder at the end of a block;
+ * before reading the buffer (scrolling, flood frames, saving), the main
+ * thread calls recordsync(), which waits for the records still in the ring
+ */
+
+/*
+ * journal
+ * -------
+ *
+ * with option -j, the rows that scroll out of the screen are appended to a
+ * file as lines; newrow() appends a record for the row, so that the recorder
+ * thread encodes it after the records that wrote it; the encoded rows are
+ * collected in journalfill, which the journal thread swaps with journalwrite
+ * and writes every JOURNALINTERVAL seconds or when JOURNALBATCH bytes are
+ * waiting; journalsync() makes it write immediately
+ */
+
+/*
+ * control socket
+ * --------------
+ *
+ * with option -q, other programs can read the buffer from the socket
+ * /run/user/UID/scrollback.N, where N is the number of the virtual terminal;
+ * a client sends one request as a line:
+ *
+ * last n	the last n rows scrolled out of the screen
+ * since p	the rows from number p on
+ * search s	the rows containing the string s, each preceded by its number
+ * follow	the rows scrolled out from now on, as they are
+ * buffer n	change the size of the buffer to n cells; without n, tell it
+ *
+ * the answer to buffer is a line with the size; to all others but follow, a
+ * line with the number of the first row, the number after the last and the
+ * length of what follows, then the lines; the socket is then closed; with fd
+ * before the request, the lines are not sent but written to a memfd, which
+ * is sealed and passed with the first line as SCM_RIGHTS
+ *
+ * the rows are numbered from the start; the number of a row is its row in
+ * the buffer plus rowbase, which a resize raises past the numbers given out
+ * so far, since the reflow makes the rows again; the recorder thread
+ * publishes in retiredrows the number after the last row scrolled out,
+ * which never decreases, and signals controlevent when
+ * some client is following them; the control thread reads the buffer without
+ * stopping the others; a row is valid while the rows on screen do not wrap
+ * around the buffer onto it, which is checked again after encoding it
+ *
+ * the geometry (buffer, size, wrapped, screen) is copied under controlmutex,
+ * and the rows are encoded and sent without it, so that a slow client does
+ * not stop a resize; the client sockets are non-blocking, and what a client
+ * does not take is kept and sent when its socket becomes writable, with no
+ * more rows encoded for it meanwhile, so that it does not stop the others; the main thread counts the changes of geometry, and the
+ * rows encoded are dropped and encoded again if it changed meanwhile; the
+ * arrays replaced while the control thread reads them are left to it to free
+ */
+
+/*
+ * prompt marks
+ * ------------
+ *
+ * shells may enclose their prompt, the command and its output in the marks
+ * ESC]133;A, B, C and D;status terminated by BEL or ESC\; the linux console
+ * does not know them, so they are not sent to it: the characters that may
+ * start one are held in markheld until they turn out not to
+ *
+ * each mark is stored with its position in the ring marks[], in order of
+ * position; a mark before the last ones drops them, since the screen has been
+ * rewritten; F9 and F10 in scroll mode find the previous or next prompt by a
+ * binary search, F5 saves the output of the last command
+ */
+
+/*
+ * timestamps
+ * ----------
+ *
+ * newrow() records the date each row is started in timeblocks[], and the
+ * first character printed in it again; this is a ring of blocks of TIMEBLOCK
+ * rows: a block has the date of its first row and the milliseconds from it
+ * of each row, four bytes per row in all; the dates increase with the rows,
+ * so the row printed at a given time is found by a binary search
+ *
+ * F6 in scroll mode shows the time of the first and last row on screen, F7
+ * asks for a number of minutes and scrolls to the rows printed that long
+ * ago; with option -T the saved and journaled lines start with their time;
+ * the offset of the timezone is taken by the main thread only, since the
+ * others may run while it forks
+ */
+
+/*
+ * colors
+ * ------
+ *
+ * the main thread follows the SGR sequences from the shell; each distinct
+ * set of colors and attributes is stored once in attributetable[], and the
+ * cells of the screen have the index of their set in screenattr[]; this is
+ * a ring of rows, so that scrolling does not move it; when a row scrolls
+ * out, newrow() appends to spans[] a span for each change of set along it,
+ * as row, column and set; rows without colors have no span, and the spans
+ * are in order of row, so that the ones of a row are found by a binary
+ * search
+ *
+ * the rows shown when scrolling are printed with a SGR sequence at each
+ * change of set; with option -a, the lines saved, streamed to less -R and
+ * written to the journal include them too
+ */
+
+/*
+ * screen snapshots
+ * ----------------
+ *
+ * programs like top redraw the screen in place, so their output does not
+ * reach the rows scrolled out; at most every SNAPSHOTINTERVAL seconds, the
+ * main thread compares the screen with the last snapshot before processing a
+ * block from the shell; if it changed, the snapshot is replaced by it and
+ * the cells that differ are stored as they were in the last snapshot, so
+ * that each snapshot is rebuilt from the next; these changes are in a ring
+ * of bytes, so that dropping the oldest does not require rebuilding the
+ * others; F8 in scroll mode shows the earlier screens, F12 the later ones;
+ * the header and the status line cover two rows, so F9 and F10 show the top
+ * and the bottom of the screen
+ */
+
+/*
+ * screen size
+ * -----------
+ *
+ * when the terminal changes size, for example by setfont, the rows are a
+ * different number of cells; resize() copies the screen to a new buffer,
+ * each row cut or extended like the linux console does, and passes the size
+ * to the shell; the rows scrolled out are reflowed to the new width by a
+ * thread: each line is the rows continuing one on the next without their
+ * trailing blanks, and lines are moved from the last to the first, so that
+ * scrolling back shows the recent ones at once; reflowlow is how far it got
+ *
+ * the new rows are numbered so that the screen starts at a new block of
+ * dates; the main thread stops the reflow if the screen scrolls enough to
+ * need the cells it is writing; the spans and marks of the reflowed rows are
+ * added when it ends, and the old buffer is freed
+ */
+
+/*
+ * buffer size
+ * -----------
+ *
+ * the size of the buffer is changed by F1 in scroll mode, by SIGUSR1 and
+ * SIGUSR2, which double and halve it, and by the control socket; the request
+ * is stored in bufferrequest and executed by the main thread between blocks
+ * of the shell; the width does not change, and neither does the numbering of
+ * the rows: bufferresize() moves the screen and the page shown to the new
+ * buffer, and the tables of the rows to new ones of the new size; the other
+ * rows scrolled out are moved by the same thread of the reflow, from the
+ * last, keeping the most recent when the new buffer is smaller; the pages of
+ * the old buffer are given back to the kernel by madvise() as they are moved,
+ * so that the memory does not double; a resize of the terminal and another
+ * change of the buffer size wait for the move to end instead of stopping it
+ */
+
+/*
+ * search
+ * ------
+ *
+ * F4 in scroll mode searches a string backwards from the bottom of the view;
+ * the buffer is scanned by findlast(), vectorized when the processor allows
+ *
+ * the scan is limited to the blocks of INDEXBLOCK cells that may contain the
+ * string: when a row scrolls out of the screen, the recorder thread adds its
+ * trigrams to the bloom filter of its block; a block may contain the string
+ * only if each trigram of the string is in its filter or in the next; blocks
+ * not yet complete and strings shorter than three characters are scanned
+ *
+ * a string containing one of .[]()*+?|^$\ is a regular expression, matched
+ * within each row; ^ and $ are the start of the row and the end of its text;
+ * the expression is compiled to a program of instructions, which is run as a
+ * dfa whose states and transitions are made only when first reached, so that
+ * each cell is looked at once; the states are dropped and rebuilt when too
+ * many; characters are mapped to classes that the expression does not tell
+ * apart, so that the transitions are a table per state
+ *
+ * F3 during a search shows only the lines containing the string
+ */
+
+/*
+ * output to the terminal
+ * ----------------------
+ *
+ * the terminal may be slow (the linux console scrolls slowly) or stopped
+ * (ctrl-S, scroll lock); writing to it blocks, and while blocked scrollback
+ * does not read the keyboard, not even the scrolling keys
+ *
+ * the terminal is therefore written through a non-blocking file descriptor
+ * opened again for it, outputfd, since the flags of the standard output are
+ * shared with the input, the shell and the programs run on the terminal;
+ * the data for it is stored in the output queue, which is written as much as possible every time
+ * the terminal can take data; the shell is not read while the queue is longer
+ * than OUTPUTLIMIT, so that it stays bounded while the keyboard is still read
+ *
+ * void outputchar(int c);
+ * void outputstring(char *s);
+ * void outputformat(char *format, ...);
+ *	append to the output queue
+ *
+ * char *outputspace(int len);
+ *	make room for len bytes at the end of the queue, to be filled and then
+ *	added to outputlen
+ *
+ * int outputflush();
+ *	write as much as possible of the queue without blocking
+ *
+ * void outputdrain();
+ *	wait until the queue is written completely; this is necessary before
+ *	running another program on the terminal, like in vtrun()
+ */
+
+/*
+ * synchronized output
+ * -------------------
+ *
+ * programs redrawing the whole screen may enclose each update between
+ * ESC[?2026h and ESC[?2026l; the linux console ignores them, and shows the
+ * partially redrawn screen every time a block of data is written to it
+ *
+ * scrollback collects everything between these two sequences in the output
+ * buffer and writes it to the terminal all at once; it flushes earlier if the
+ * end sequence does not come within SYNCTIMEOUT microseconds, or if it needs
+ * to ask the cursor position; the common cursor movement sequences are
+ * followed by movecursor() so that this is seldom necessary
+ */
+
 /*
  * direct access to the terminal
  * -----------------------------
@@ -116,6 +438,7 @@
  * retrieved by scrolling up
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <fcntl.h>
@@ -127,6 +450,29 @@
 #include <sys/wait.h>
 #include <errno.h>
 #include <locale.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>
+#include <linux/io_uring.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <pthread.h>
+#include <sched.h>
+#include <spawn.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+#include <time.h>
+#include <sys/ioctl.h>
 #include <pty.h>
 #include <utmp.h>
 #include <linux/kd.h>
@@ -157,27 +503,76 @@ int singlechar;
 #define DEBUGESCAPE 0x01
 #define DEBUGBUFFER 0x02
 #define DEBUGKEYS   0x04
+#define DEBUGSTATS  0x08
 int debug;
 
 FILE *logescape;
 FILE *logbuffer;
+FILE *logstats;
 
 #define LOGDIR    "/run/user/%d"
 #define LOGESCAPE (LOGDIR "/" "logescape")
 #define LOGBUFFER (LOGDIR "/" "logbuffer")
+#define LOGSTATS  (LOGDIR "/" "logstats")
+
+/*
+ * statistics, saved at exit if debug includes DEBUGSTATS
+ */
+struct {
+	long long start;	/* time of start, in microseconds */
+	long long shellbytes;	/* bytes read from the shell */
+	long long dropped;	/* bytes not sent to the terminal on floods */
+	long long frames;	/* screen updates when flooding */
+	long long syncframes;	/* synchronized updates */
+	long long synctimeouts;	/* synchronized updates ended by timeout */
+	long long collapsed;	/* blocks not written when synchronized */
+	long long wakeups;	/* returns from epoll_wait() */
+	long long idle;		/* wakeups with no data read or written */
+	long long latency;	/* total time processing events */
+	long long maxlatency;	/* maximal time processing events */
+	long long syscalls;	/* system calls in the main loop */
+	long long savetime;	/* time taken by the last save */
+	long long savefork;	/* time the session stopped for it */
+	long long searchtime;	/* time taken by the last search */
+	int searchblocks;	/* blocks in the last search */
+	int searchskipped;	/* of them, the ones without the string */
+	int saveprocesses;	/* processes encoding the last save */
+	long long journalbytes;	/* bytes written to the journal */
+	long long journalsyncs;	/* calls to fdatasync() on the journal */
+	long long journallost;	/* rows or bytes not written to the journal */
+	long long attributeslost;	/* sets not stored, table full */
+	int resizes;		/* changes of the screen size */
+	long long resizetime;	/* time the last one stopped the session */
+	long long reflowtime;	/* time taken by the last reflow */
+	int reflowrows;		/* rows it made */
+	int buffersizes;	/* changes of the buffer size */
+	long long buffertime;	/* time the last one stopped the session */
+	long long movetime;	/* time taken to move the rows to the new one */
+	int moverows;		/* rows moved */
+} stats;
 
 /*
  * keys and escape sequences
  */
 #define ESCAPE                0x1B
+#define BEL                   0x07
 #define BS                    0x08
+#define TAB                   0x09
 #define NL                    0x0A
 #define FF                    0x0C
 #define CR                    0x0D
 #define DEL                   0x7F
 
+#define KEYF1                 "\033[[A"
 #define KEYF2                 "\033[[B"
 #define KEYF3                 "\033[[C"
+#define KEYF4                 "\033[[D"
+#define KEYF5                 "\033[[E"
+#define KEYF6                 "\033[17~"
+#define KEYF7                 "\033[18~"
+#define KEYF8                 "\033[19~"
+#define KEYF9                 "\033[20~"
+#define KEYF10                "\033[21~"
 #define KEYF11                "\033[23~"
 #define KEYF12                "\033[24~"
 #define KEYSHIFTPAGEUP        "\033[11~"
@@ -188,10 +583,11 @@ FILE *logbuffer;
 #define SEQUENCE2ARGS         "%c[%d;%d%c"
 #define SEQUENCESTARTER        ESCAPE
 #define GETPOSITIONTERMINATOR          'R'
-#define MOVECURSORTERMINATOR           'H'
 #define MOVECURSORUP          "\033[1A"
+#define MOVECURSOR            "\033[%d;%dH"
 #define RESETATTRIBUTES       "\033[0m"
 #define BLUEBACKGROUND        "\033[44m"
+#define REVERSEVIDEO          "\033[7m"
 #define NORMALBACKGROUND      "\033[49m"
 #define ERASECURSORDISPLAY    "\033[J"
 #define ERASEDISPLAY          "\033[2J"
@@ -203,6 +599,10 @@ FILE *logbuffer;
 #define MAKECURSORINVISIBLE   "\033[25l"
 #define BREAKOUT              "\033[0;%d%c"
 #define BREAKOUTTERMINATOR              'v'
+#define BEGINSYNCHRONIZED     "\033[?2026h"
+#define ENDSYNCHRONIZED       "\033[?2026l"
+#define PROMPTMARK            "\033]133;"
+#define SEQUENCELEN 40
 
 /*
  * print an escape sequence in readable form
@@ -219,6 +619,59 @@ void printescape(FILE *fd, unsigned char *sequence) {
 	fprintf(fd, "\n");
 }
 
+/*
+ * current time in microseconds
+ */
+long long microseconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+/*
+ * current date in milliseconds
+ */
+long long milliseconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/*
+ * local representation of a date in milliseconds, 23 characters; the offset
+ * of the timezone is taken by the main thread, so that the others do not call
+ * localtime_r() while it may fork; it is taken again at each snapshot and
+ * before forking, to follow the changes of daylight saving time
+ */
+long timezoneoffset;
+void timezoneupdate() {
+	time_t t;
+	struct tm tm;
+
+	tzset();
+	t = time(NULL);
+	localtime_r(&t, &tm);
+	__atomic_store_n(&timezoneoffset, tm.tm_gmtoff, __ATOMIC_RELAXED);
+}
+int timeformat(char *dest, long long ms) {
+	long long s, days, z, era, doe, yoe, doy, mp, y, m, d;
+
+	s = ms / 1000 + __atomic_load_n(&timezoneoffset, __ATOMIC_RELAXED);
+	days = s / 86400;
+	s %= 86400;
+	z = days + 719468;
+	era = (z >= 0 ? z : z - 146096) / 146097;
+	doe = z - era * 146097;
+	yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+	doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+	mp = (5 * doy + 2) / 153;
+	d = doy - (153 * mp + 2) / 5 + 1;
+	m = mp < 10 ? mp + 3 : mp - 9;
+	y = yoe + era * 400 + (m <= 2);
+	return sprintf(dest, "%04lld-%02lld-%02lld %02lld:%02lld:%02lld.%03lld",
+		y, m, d, s / 3600, s / 60 % 60, s % 60, ms % 1000);
+}
+
 /*
  * set escape sequence for a key
  */
@@ -392,6 +845,21 @@ u_int32_t utf8toucs4(unsigned char *utf8) {
 	else
 		return -1;
 }
+int utf8tocells(u_int32_t *dest, int max, char *src, int len) {
+	int i, n, l;
+
+	n = 0;
+	for (i = 0; i < len && n < max; i += l) {
+		l = singlechar || (src[i] & 0x80) == 0 ? 1 :
+		    (src[i] & 0xE0) == 0xC0 ? 2 :
+		    (src[i] & 0xF0) == 0xE0 ? 3 : 4;
+		if (i + l > len)
+			break;
+		dest[n++] = singlechar ? (unsigned char) src[i] :
+			utf8toucs4((unsigned char *) src + i);
+	}
+	return n;
+}
 void ucs4toutf8(u_int32_t ucs4, char buf[10]) {
 	if (ucs4 < 0x80) {
 		buf[0] = ucs4;
@@ -418,217 +886,4199 @@ void ucs4toutf8(u_int32_t ucs4, char buf[10]) {
 }
 
 /*
- * the virtual terminal
- */
-int vtno;		/* number of the virtual terminal */
-int vtfd;		/* terminal file descriptor */
-
-/*
- * run a program directly on the virtual terminal
+ * convert a block of ucs4 characters to utf8, without the final '\0'; dest
+ * has room for four bytes for each character; return the length
  */
-void vtrun() {
-	char buf[100];
-	char *argv[] = {"sh", NULL, NULL};
-	pid_t pid;
-
-	if (debug & DEBUGESCAPE)
-		fflush(logescape);
+int ucs4toutf8scalar(char *dest, u_int32_t *src, int n) {
+	char *d;
+	u_int32_t c;
+	int i;
 
-	pid = fork();
-	if (pid == 0) {
-		sprintf(buf, "%s/.scrollback.%d", getenv("HOME"), vtno);
-		argv[1] = buf;
-		if (debug & DEBUGESCAPE) {
-			fprintf(logescape, "\n[run:%s", buf);
-			fflush(logescape);
+	d = dest;
+	for (i = 0; i < n; i++) {
+		c = src[i];
+		if (c < 0x80)
+			*d++ = c;
+		else if (c < 0x0800) {
+			*d++ = 0xC0 | ((c >>  6) & 0x1F);
+			*d++ = 0x80 | ((c >>  0) & 0x3F);
+		}
+		else if (c < 0x10000) {
+			*d++ = 0xE0 | ((c >> 12) & 0x0F);
+			*d++ = 0x80 | ((c >>  6) & 0x3F);
+			*d++ = 0x80 | ((c >>  0) & 0x3F);
+		}
+		else {
+			*d++ = 0xF0 | ((c >> 18) & 0x07);
+			*d++ = 0x80 | ((c >> 12) & 0x3F);
+			*d++ = 0x80 | ((c >>  6) & 0x3F);
+			*d++ = 0x80 | ((c >>  0) & 0x3F);
 		}
-		if (vtfd != -1)
-			close(vtfd);
-		enablelinebuffering();
-		execvp(argv[0], argv);
-		perror(argv[0]);
-		exit(EXIT_FAILURE);
 	}
-
-	waitpid(pid, NULL, 0);
-	disablelinebuffering();
-	if (debug & DEBUGESCAPE)
-		fprintf(logescape, "]\n");
+	return d - dest;
 }
 
+#if defined(__x86_64__) || defined(__i386__)
+
 /*
- * delete the script containing the program to run
+ * same, with sse2: 16 ascii characters or 8 two-byte characters at time
  */
-void deletescript(int warn) {
-	char buf[40];
-	sprintf(buf, "%s/.scrollback.%d", getenv("HOME"), vtno);
-	if (-1 == unlink(buf) && warn)
-		perror(buf);
+__attribute__((target("sse2")))
+int ucs4toutf8sse2(char *dest, u_int32_t *src, int n) {
+	__m128i a, b, c, d, lo, hi;
+	__m128i ascii = _mm_set1_epi32(~0x7F);
+	__m128i zero = _mm_setzero_si128();
+	__m128i min2 = _mm_set1_epi32(0x7F), max2 = _mm_set1_epi32(0x800);
+	__m128i bias = _mm_set1_epi32(0x8000), bias16 = _mm_set1_epi16(-0x8000);
+	char *p;
+	int i, k;
+
+	p = dest;
+	for (i = 0; i < n; ) {
+		if (i + 16 <= n) {
+			a = _mm_loadu_si128((__m128i *) (src + i));
+			b = _mm_loadu_si128((__m128i *) (src + i + 4));
+			c = _mm_loadu_si128((__m128i *) (src + i + 8));
+			d = _mm_loadu_si128((__m128i *) (src + i + 12));
+			lo = _mm_or_si128(_mm_or_si128(a, b),
+				_mm_or_si128(c, d));
+			if (_mm_movemask_epi8(_mm_cmpeq_epi32(
+			    _mm_and_si128(lo, ascii), zero)) == 0xFFFF) {
+				_mm_storeu_si128((__m128i *) p,
+					_mm_packus_epi16(
+						_mm_packs_epi32(a, b),
+						_mm_packs_epi32(c, d)));
+				p += 16;
+				i += 16;
+				continue;
+			}
+		}
+		if (i + 8 <= n) {
+			a = _mm_loadu_si128((__m128i *) (src + i));
+			b = _mm_loadu_si128((__m128i *) (src + i + 4));
+			lo = _mm_and_si128(
+				_mm_and_si128(_mm_cmpgt_epi32(a, min2),
+				              _mm_cmplt_epi32(a, max2)),
+				_mm_and_si128(_mm_cmpgt_epi32(b, min2),
+				              _mm_cmplt_epi32(b, max2)));
+			if (_mm_movemask_epi8(lo) == 0xFFFF) {
+				/* first byte 110xxxxx, second 10xxxxxx */
+				hi = _mm_or_si128(_mm_srli_epi32(a, 6),
+					_mm_set1_epi32(0xC0));
+				lo = _mm_or_si128(_mm_and_si128(a,
+					_mm_set1_epi32(0x3F)),
+					_mm_set1_epi32(0x80));
+				a = _mm_or_si128(hi, _mm_slli_epi32(lo, 8));
+				hi = _mm_or_si128(_mm_srli_epi32(b, 6),
+					_mm_set1_epi32(0xC0));
+				lo = _mm_or_si128(_mm_and_si128(b,
+					_mm_set1_epi32(0x3F)),
+					_mm_set1_epi32(0x80));
+				b = _mm_or_si128(hi, _mm_slli_epi32(lo, 8));
+				/* no unsigned pack in sse2: bias to signed */
+				a = _mm_packs_epi32(_mm_sub_epi32(a, bias),
+				                    _mm_sub_epi32(b, bias));
+				_mm_storeu_si128((__m128i *) p,
+					_mm_sub_epi16(a, bias16));
+				p += 16;
+				i += 8;
+				continue;
+			}
+		}
+		k = n - i < 32 ? n - i : 32;
+		p += ucs4toutf8scalar(p, src + i, k);
+		i += k;
+	}
+	return p - dest;
 }
 
 /*
- * the scrollback buffer
+ * same, with avx2: 32 ascii characters or 16 two-byte characters at time
  */
-int buffersize;
-u_int32_t *buffer;
-int origin;		/* start of region storing a copy of the screen */
-int show;		/* start of region that is shown when scrolling */
+__attribute__((target("avx2")))
+int ucs4toutf8avx2(char *dest, u_int32_t *src, int n) {
+	__m256i a, b, c, d, lo, hi;
+	__m256i ascii = _mm256_set1_epi32(~0x7F);
+	__m256i min2 = _mm256_set1_epi32(0x7F), max2 = _mm256_set1_epi32(0x800);
+	__m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+	char *p;
+	int i, k;
+
+	p = dest;
+	for (i = 0; i < n; ) {
+		if (i + 32 <= n) {
+			a = _mm256_loadu_si256((__m256i *) (src + i));
+			b = _mm256_loadu_si256((__m256i *) (src + i + 8));
+			c = _mm256_loadu_si256((__m256i *) (src + i + 16));
+			d = _mm256_loadu_si256((__m256i *) (src + i + 24));
+			lo = _mm256_or_si256(_mm256_or_si256(a, b),
+			                     _mm256_or_si256(c, d));
+			if (_mm256_testz_si256(lo, ascii)) {
+				/* packs work within 128-bit lanes */
+				lo = _mm256_packus_epi16(
+					_mm256_packs_epi32(a, b),
+					_mm256_packs_epi32(c, d));
+				_mm256_storeu_si256((__m256i *) p,
+					_mm256_permutevar8x32_epi32(lo, order));
+				p += 32;
+				i += 32;
+				continue;
+			}
+		}
+		if (i + 16 <= n) {
+			a = _mm256_loadu_si256((__m256i *) (src + i));
+			b = _mm256_loadu_si256((__m256i *) (src + i + 8));
+			lo = _mm256_and_si256(
+				_mm256_and_si256(_mm256_cmpgt_epi32(a, min2),
+				                 _mm256_cmpgt_epi32(max2, a)),
+				_mm256_and_si256(_mm256_cmpgt_epi32(b, min2),
+				                 _mm256_cmpgt_epi32(max2, b)));
+			if (_mm256_movemask_epi8(lo) == -1) {
+				hi = _mm256_or_si256(_mm256_srli_epi32(a, 6),
+					_mm256_set1_epi32(0xC0));
+				lo = _mm256_or_si256(_mm256_and_si256(a,
+					_mm256_set1_epi32(0x3F)),
+					_mm256_set1_epi32(0x80));
+				a = _mm256_or_si256(hi,
+					_mm256_slli_epi32(lo, 8));
+				hi = _mm256_or_si256(_mm256_srli_epi32(b, 6),
+					_mm256_set1_epi32(0xC0));
+				lo = _mm256_or_si256(_mm256_and_si256(b,
+					_mm256_set1_epi32(0x3F)),
+					_mm256_set1_epi32(0x80));
+				b = _mm256_or_si256(hi,
+					_mm256_slli_epi32(lo, 8));
+				lo = _mm256_packus_epi32(a, b);
+				_mm256_storeu_si256((__m256i *) p,
+					_mm256_permute4x64_epi64(lo, 0xD8));
+				p += 32;
+				i += 16;
+				continue;
+			}
+		}
+		k = n - i < 32 ? n - i : 32;
+		p += ucs4toutf8scalar(p, src + i, k);
+		i += k;
+	}
+	return p - dest;
+}
+
+#endif
 
 /*
- * the screen
+ * last occurrence of a string of m characters in a block of n characters,
+ * -1 if none
  */
-struct winsize winsize;	/* screen size */
-int row, col;		/* position of the cursor */
-int positionstatus;	/* is the cursor position known? */
-#define POSITION_UNKNOWN   0
-#define POSITION_KNOWN     1
-#define POSITION_UNCERTAIN 2
+int findlastscalar(u_int32_t *block, int n, u_int32_t *string, int m) {
+	int i;
+
+	for (i = n - m; i >= 0; i--)
+		if (block[i] == string[0] &&
+		    block[i + m - 1] == string[m - 1] &&
+		    ! memcmp(block + i, string, m * sizeof(u_int32_t)))
+			return i;
+	return -1;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
 
 /*
- * message to the user when scrolling
+ * same, with sse2: compare the first and last character of the string at 4
+ * positions at time, then check the candidates
  */
-void notify(char *message) {
-	fprintf(stdout, "\033[%d;%dH", winsize.ws_row + 1, 38);
-	fprintf(stdout, "%.41s ", message);
-	fflush(stdout);
+__attribute__((target("sse2")))
+int findlastsse2(u_int32_t *block, int n, u_int32_t *string, int m) {
+	__m128i first, last, a, b;
+	int top, mask, bit;
+
+	first = _mm_set1_epi32(string[0]);
+	last = _mm_set1_epi32(string[m - 1]);
+	for (top = n - m + 1; top >= 4; top -= 4) {
+		a = _mm_loadu_si128((__m128i *) (block + top - 4));
+		b = _mm_loadu_si128((__m128i *) (block + top - 4 + m - 1));
+		mask = _mm_movemask_ps(_mm_castsi128_ps(_mm_and_si128(
+			_mm_cmpeq_epi32(a, first), _mm_cmpeq_epi32(b, last))));
+		for (; mask != 0; mask &= ~(1 << bit)) {
+			bit = 31 - __builtin_clz(mask);
+			if (! memcmp(block + top - 4 + bit, string,
+			             m * sizeof(u_int32_t)))
+				return top - 4 + bit;
+		}
+	}
+	return top <= 0 ? -1 : findlastscalar(block, top + m - 1, string, m);
 }
 
 /*
- * show a segment of the scrollback buffer on screen
+ * same, with avx2: 8 positions at time
  */
-#define BARUP   "       " BLUEBACKGROUND "↑↑↑↑↑↑↑↑↑" NORMALBACKGROUND
-#define BARDOWN "       " BLUEBACKGROUND "↓↓↓↓↓↓↓↓↓" NORMALBACKGROUND
-void showscrollback() {
-	int size, all, rows, i;
-	char buf[10];
-	u_int32_t c, prev;
-
-	size = (winsize.ws_row - (show == origin ? 0 : 2)) * winsize.ws_col;
-	fprintf(stdout, MAKECURSORINVISIBLE HOMEPOSITION RESETATTRIBUTES);
-	if (show != origin) {
-		all = winsize.ws_row * winsize.ws_col;
-		rows = (buffersize - all) / winsize.ws_col;
-		if (show - winsize.ws_col >= 0 &&
-		    rows > (origin - show) / winsize.ws_col)
-			fprintf(stdout, BARUP);
-		fprintf(stdout, ERASECURSORLINE "\r\n");
-	}
-	prev = 0;
-	for (i = 0; i < size; i++) {
-		c = buffer[(show + i) % buffersize];
-		if (singlechar) {
-			if (prev >= 0xC0 && c >= 0x80 && c < 0xC0)
-				putc(DEL, stdout);
-			putc(c, stdout);
-		}
-		else {
-			ucs4toutf8(c, buf);
-			fputs(buf, stdout);
+__attribute__((target("avx2")))
+int findlastavx2(u_int32_t *block, int n, u_int32_t *string, int m) {
+	__m256i first, last, a, b;
+	int top, mask, bit;
+
+	first = _mm256_set1_epi32(string[0]);
+	last = _mm256_set1_epi32(string[m - 1]);
+	for (top = n - m + 1; top >= 8; top -= 8) {
+		a = _mm256_loadu_si256((__m256i *) (block + top - 8));
+		b = _mm256_loadu_si256((__m256i *) (block + top - 8 + m - 1));
+		mask = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_and_si256(
+			_mm256_cmpeq_epi32(a, first),
+			_mm256_cmpeq_epi32(b, last))));
+		for (; mask != 0; mask &= ~(1 << bit)) {
+			bit = 31 - __builtin_clz(mask);
+			if (! memcmp(block + top - 8 + bit, string,
+			             m * sizeof(u_int32_t)))
+				return top - 8 + bit;
 		}
-		prev = c;
-	}
-	if (show != origin) {
-		fprintf(stdout, BARDOWN "   %d lines below" ERASECURSORLINE,
-			(origin - show) / winsize.ws_col + 2);
-		notify("F2=save F3=less");
 	}
-	else
-		fprintf(stdout, RESTORECURSOR MAKECURSORVISIBLE);
-	fflush(stdout);
+	return top <= 0 ? -1 : findlastscalar(block, top + m - 1, string, m);
 }
 
+#endif
+
 /*
- * save the scrollback buffer to a file
+ * the fastest conversion and search the processor supports
  */
-void savebuffer(char *command) {
-	char path[4096], exe[8192];
-	int all, size, start, i;
-	char buf[10];
-	u_int32_t c;
-	FILE *savefile;
-	int res;
-
-	if (debug & DEBUGESCAPE) {
-		fprintf(logescape, "[savebuffer]");
-		fflush(logescape);
+int (*ucs4toutf8block)(char *dest, u_int32_t *src, int n) =
+	ucs4toutf8scalar;
+int (*findlast)(u_int32_t *block, int n, u_int32_t *string, int m) =
+	findlastscalar;
+void simdinit() {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		ucs4toutf8block = ucs4toutf8avx2;
+		findlast = findlastavx2;
 	}
-
-	snprintf(path, 4096, LOGDIR "/scrollbackbuffer", getuid());
-	savefile = fopen(path, "w");
-	if (savefile == NULL) {
-		notify("cannot create file\n");
-		return;
+	else if (__builtin_cpu_supports("sse2")) {
+		ucs4toutf8block = ucs4toutf8sse2;
+		findlast = findlastsse2;
 	}
+#endif
+}
 
-	all = (buffersize / winsize.ws_col) * winsize.ws_col;
-	size = winsize.ws_row * winsize.ws_col;
-	start = origin - all + size <= 0 ? 0 : origin - all + size;
-	for (i = 0; i < all && i < origin + size; i++) {
-		c = buffer[(start + i) % buffersize];
-		if (singlechar)
-			putc(c, savefile);
-		else {
-			ucs4toutf8(c, buf);
-			fputs(buf, savefile);
-		}
-	}
+/*
+ * event loop
+ */
+int epollfd;		/* the epoll instance */
+int signalfile;		/* signalfd for the signals blocked */
+int querytimer;		/* timeout for cursor position queries */
+int flushtimer;		/* timeout for synchronized output */
+int querytimeout;	/* querytimer expired */
+sigset_t signalmask;	/* original signal mask, for the called programs */
+pid_t shellpid;		/* process of the shell */
+int shellexited;	/* the shell terminated */
+int terminate;		/* SIGTERM received */
+unsigned masterevents;	/* events watched on the shell */
+unsigned outputevents;	/* events watched on the terminal output */
+#define MAXEVENTS 16
+#define POSITIONTIMEOUT 400000
 
-	fclose(savefile);
+/*
+ * set the events to wait for on a file descriptor
+ */
+void watch(int fd, unsigned events, unsigned *current) {
+	struct epoll_event ev;
+	int op;
 
-	if (command == NULL) {
-		notify("scrollback buffer saved");
+	if (*current == events)
 		return;
+	op = events == 0 ? EPOLL_CTL_DEL :
+		*current == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+	ev.events = events;
+	ev.data.fd = fd;
+	stats.syscalls++;
+	if (epoll_ctl(epollfd, op, fd, &ev) == -1) {
+		perror("epoll_ctl");
+		exit(EXIT_FAILURE);
 	}
-	snprintf(exe, 8192, "%s %s", command, path);
-	notify(exe);
-	notify(MOVECURSORUP "\b\b ");
-	res = system(exe);
-	if (res == -1)
-		notify(strerror(errno));
-	if (res == -1 || ! WIFEXITED(res) || WEXITSTATUS(res) == 127)
-		sleep(2);
-	showscrollback();
+	*current = events;
 }
 
 /*
- * exchange one block of data between terminal and shell (forward declaration)
+ * start or stop a timer
  */
-int exchange(int master, int readshell, struct timeval *timeout);
+void armtimer(int timer, long long usec) {
+	struct itimerspec its;
+
+	its.it_interval.tv_sec = 0;
+	its.it_interval.tv_nsec = 0;
+	its.it_value.tv_sec = usec / 1000000;
+	its.it_value.tv_nsec = usec % 1000000 * 1000;
+	timerfd_settime(timer, 0, &its, NULL);
+}
 
 /*
- * make the current position known
+ * consume the expiration of a timer
  */
-void knowposition(int master, int alreadyasked) {
-	struct timeval tv;
-	int i;
+void readtimer(int timer) {
+	u_int64_t expirations;
+	read(timer, &expirations, sizeof(expirations));
+}
 
-	if (! alreadyasked && positionstatus == POSITION_KNOWN)
-		return;
+/*
+ * input thread
+ */
+pthread_t inputthread;
+int inputevent;		/* eventfd: keys for the main thread */
+int inputcontrol;	/* eventfd: request for the input thread */
+int inputready;		/* inputevent is readable */
+int inputmaster;	/* the shell, for the input thread */
+#define INPUTRING 4096
+char inputring[INPUTRING];
+unsigned inputhead;	/* written by the input thread */
+unsigned inputtaken;	/* copied by the main thread */
+unsigned inputtail;	/* processed by the main thread */
+int inputdepth;		/* nesting of inputblock() */
+int scrolled;		/* show != origin, for the input thread */
+int inputfailed;	/* reading the terminal failed */
+int inputstate;		/* what the input thread is asked to do */
+int inputpaused;	/* the input thread is not reading the terminal */
+#define INPUT_RUN   0
+#define INPUT_PAUSE 1
+#define INPUT_QUIT  2
+pthread_mutex_t inputmutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t inputcond = PTHREAD_COND_INITIALIZER;
 
-	if (debug & DEBUGESCAPE)
-		fprintf(logescape, "[knowposition(%d)]", alreadyasked);
+/*
+ * io_uring
+ */
+int useuring;		/* use io_uring instead of epoll */
+int uring;		/* io_uring file descriptor, -1 if not used */
+struct {
+	unsigned *head, *tail, *mask, *array;
+	unsigned entries;
+	unsigned pending;	/* prepared but not made visible yet */
+	struct io_uring_sqe *sqes;
+} sq;
+struct {
+	unsigned *head, *tail, *mask;
+	struct io_uring_cqe *cqes;
+} cq;
+void *sqring, *cqring;
+size_t sqringsize, cqringsize, sqessize;
+#define BLOCKSIZE 1024
+char uringbuffer[BLOCKSIZE];	/* registered buffer */
+int shellinflight;	/* a read from the shell is submitted */
+int eventsinflight;	/* a poll on epollfd is submitted */
+int writeinflight;	/* a write to the terminal is submitted */
+int shellstash;		/* data read from the shell, not processed yet */
+#define URINGENTRIES 16
+#define URING_SHELL    2
+#define URING_WRITE    3
+#define URING_EVENTS   4
+#define URING_CANCEL   5
 
-	if (! alreadyasked) {
-		fprintf(stdout, ASKPOSITION);
-		fflush(stdout);
+/*
+ * create the io_uring instance
+ */
+int uringsetup() {
+	struct io_uring_params p;
+	struct iovec iov;
+	int single;
+
+	memset(&p, 0, sizeof(p));
+	uring = syscall(__NR_io_uring_setup, URINGENTRIES, &p);
+	if (uring == -1)
+		return -1;
+
+	sqringsize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cqringsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	single = p.features & IORING_FEAT_SINGLE_MMAP;
+	if (single && cqringsize > sqringsize)
+		sqringsize = cqringsize;
+	sqring = mmap(NULL, sqringsize, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, uring, IORING_OFF_SQ_RING);
+	cqring = single ? sqring :
+		mmap(NULL, cqringsize, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, uring, IORING_OFF_CQ_RING);
+	sqessize = p.sq_entries * sizeof(struct io_uring_sqe);
+	sq.sqes = mmap(NULL, sqessize, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, uring, IORING_OFF_SQES);
+	if (sqring == MAP_FAILED || cqring == MAP_FAILED ||
+	    sq.sqes == MAP_FAILED) {
+		close(uring);
+		uring = -1;
+		return -1;
 	}
 
-	positionstatus = POSITION_UNKNOWN;
-	for (i = 0; i < 4 && positionstatus == POSITION_UNKNOWN; i++) {
-		tv.tv_sec = 0;
-		tv.tv_usec = 100000;
-		exchange(master, 0, &tv);
-		// fixme: if return is -1, terminate everything
+	sq.head = sqring + p.sq_off.head;
+	sq.tail = sqring + p.sq_off.tail;
+	sq.mask = sqring + p.sq_off.ring_mask;
+	sq.array = sqring + p.sq_off.array;
+	sq.entries = p.sq_entries;
+	sq.pending = 0;
+	cq.head = cqring + p.cq_off.head;
+	cq.tail = cqring + p.cq_off.tail;
+	cq.mask = cqring + p.cq_off.ring_mask;
+	cq.cqes = cqring + p.cq_off.cqes;
+
+	iov.iov_base = uringbuffer;
+	iov.iov_len = BLOCKSIZE;
+	if (syscall(__NR_io_uring_register, uring,
+	            IORING_REGISTER_BUFFERS, &iov, 1) == -1) {
+		close(uring);
+		uring = -1;
+		return -1;
 	}
+
+	shellinflight = 0;
+	eventsinflight = 0;
+	writeinflight = 0;
+	shellstash = -1;
+	return 0;
 }
 
 /*
- * obtain the current position from an escape sequence
+ * release the io_uring instance
  */
-int readposition(char *sequence, char terminator) {
-	char s, t;
-	int x, y;
-
+void uringclose() {
+	if (uring == -1)
+		return;
+	close(uring);
+	munmap(sq.sqes, sqessize);
+	if (cqring != sqring)
+		munmap(cqring, cqringsize);
+	munmap(sqring, sqringsize);
+	uring = -1;
+}
+
+/*
+ * prepare a submission; all are submitted by the next uringenter()
+ */
+struct io_uring_sqe *uringsqe(int op, int fd, void *addr, unsigned len,
+		u_int64_t data) {
+	struct io_uring_sqe *sqe;
+	unsigned index;
+
+	index = (*sq.tail + sq.pending) & *sq.mask;
+	sqe = &sq.sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long) addr;
+	sqe->len = len;
+	if (op == IORING_OP_READ_FIXED || op == IORING_OP_WRITE)
+		sqe->off = -1;		/* current position */
+	sqe->user_data = data;
+	sq.array[index] = index;
+	sq.pending++;
+	return sqe;
+}
+
+/*
+ * submit the prepared requests, possibly waiting for a completion
+ */
+int uringenter(int wait) {
+	unsigned submit;
+
+	__atomic_store_n(sq.tail, *sq.tail + sq.pending, __ATOMIC_RELEASE);
+	sq.pending = 0;
+	submit = *sq.tail - __atomic_load_n(sq.head, __ATOMIC_ACQUIRE);
+	if (submit == 0 && ! wait)
+		return 0;
+	stats.syscalls++;
+	return syscall(__NR_io_uring_enter, uring, submit, wait ? 1 : 0,
+		wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+
+/*
+ * process the completions (forward declaration)
+ */
+int uringcomplete();
+
+/*
+ * output queue
+ */
+char *output;		/* data not yet written to the terminal */
+int outputlen;		/* length of data */
+int outputsize;		/* allocated size */
+int outputfd;		/* the terminal, opened again as non-blocking */
+char *writing;		/* data being written by io_uring */
+int writinglen;		/* length of data being written */
+int writingoff;		/* how much of it is already written */
+int writingsize;	/* allocated size */
+int writingchunk;	/* size of the write in progress */
+#define WRITECHUNK 4096
+#define OUTPUTLIMIT (128 * 1024)
+#define CAN 0x18
+
+/*
+ * append to the output queue
+ */
+char *outputspace(int len) {
+	if (outputlen + len > outputsize) {
+		while (outputlen + len > outputsize)
+			outputsize = outputsize == 0 ? 4096 : outputsize * 2;
+		output = realloc(output, outputsize);
+		if (output == NULL) {
+			perror("output queue");
+			exit(EXIT_FAILURE);
+		}
+	}
+	return output + outputlen;
+}
+void outputdata(char *data, int len) {
+	memcpy(outputspace(len), data, len);
+	outputlen += len;
+}
+void outputchar(int c) {
+	char b = c;
+	outputdata(&b, 1);
+}
+void outputstring(char *s) {
+	outputdata(s, strlen(s));
+}
+void outputformat(char *format, ...) {
+	va_list ap;
+	char buf[1024];
+	int len;
+
+	va_start(ap, format);
+	len = vsnprintf(buf, sizeof(buf), format, ap);
+	va_end(ap);
+	outputdata(buf, len < (int) sizeof(buf) ? len : (int) sizeof(buf) - 1);
+}
+
+/*
+ * write the output queue to the terminal as much as possible
+ */
+int outputflush() {
+	int len;
+	char *swap;
+
+	if (uring != -1) {
+		if (writeinflight)
+			return 0;
+		if (writinglen == 0) {
+			if (outputlen == 0)
+				return 0;
+			swap = writing;
+			writing = output;
+			output = swap;
+			len = writingsize;
+			writingsize = outputsize;
+			outputsize = len;
+			writinglen = outputlen;
+			writingoff = 0;
+			outputlen = 0;
+		}
+		writingchunk = writinglen - writingoff;
+		if (writingchunk > WRITECHUNK)
+			writingchunk = WRITECHUNK;
+		uringsqe(IORING_OP_WRITE, outputfd, writing + writingoff,
+			writingchunk, URING_WRITE);
+		writeinflight = 1;
+		return 0;
+	}
+
+	while (outputlen > 0) {
+		stats.syscalls++;
+		len = write(outputfd, output, outputlen);
+		if (len == -1 && errno == EINTR)
+			continue;
+		if (len == -1 && errno == EAGAIN)
+			return 0;
+		if (len == -1) {
+			outputlen = 0;
+			return -1;
+		}
+		memmove(output, output + len, outputlen - len);
+		outputlen -= len;
+	}
+	return 0;
+}
+
+/*
+ * write the whole output queue to the terminal
+ */
+void outputdrain() {
+	struct pollfd pfd;
+
+	if (uring != -1) {
+		while (outputlen > 0 || writinglen > 0) {
+			outputflush();
+			if (uringenter(1) == -1 && errno != EINTR)
+				break;
+			uringcomplete();
+		}
+		return;
+	}
+
+	pfd.fd = outputfd;
+	pfd.events = POLLOUT;
+	while (outputlen > 0 && outputflush() == 0)
+		if (outputlen > 0)
+			poll(&pfd, 1, -1);
+}
+
+/*
+ * drop the data in the output queue; cancel a partial escape sequence
+ */
+void outputdiscard() {
+	outputlen = 0;
+	if (uring != -1)
+		writinglen = writeinflight ? writingoff + writingchunk : 0;
+	outputchar(CAN);
+}
+
+/*
+ * open the terminal again for the output queue, with a file description of
+ * its own, so that the standard output stays blocking for the others; with
+ * io_uring, or if it cannot be opened, the standard output is used as it is
+ */
+void outputopen() {
+	char *name;
+
+	outputfd = -1;
+	if (uring == -1) {
+		outputfd = open("/proc/self/fd/1",
+			O_WRONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+		name = ttyname(STDOUT_FILENO);
+		if (outputfd == -1 && name != NULL)
+			outputfd = open(name,
+				O_WRONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+	}
+	if (outputfd == -1)
+		outputfd = STDOUT_FILENO;
+}
+void outputclose() {
+	if (outputfd != STDOUT_FILENO)
+		close(outputfd);
+	outputfd = STDOUT_FILENO;
+}
+
+/*
+ * the virtual terminal
+ */
+int vtno;		/* number of the virtual terminal */
+int vtfd;		/* terminal file descriptor */
+
+/*
+ * stop and restart reading the terminal (forward declarations)
+ */
+void inputpause();
+void inputresume();
+
+/*
+ * run a program directly on the virtual terminal
+ */
+void vtrun() {
+	char buf[100];
+	char *argv[] = {"sh", NULL, NULL};
+	pid_t pid;
+
+	if (debug & DEBUGESCAPE)
+		fflush(logescape);
+
+	inputpause();
+	outputdrain();
+	pid = fork();
+	if (pid == 0) {
+		sprintf(buf, "%s/.scrollback.%d", getenv("HOME"), vtno);
+		argv[1] = buf;
+		if (debug & DEBUGESCAPE) {
+			fprintf(logescape, "\n[run:%s", buf);
+			fflush(logescape);
+		}
+		if (vtfd != -1)
+			close(vtfd);
+		enablelinebuffering();
+		sigprocmask(SIG_SETMASK, &signalmask, NULL);
+		execvp(argv[0], argv);
+		perror(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	waitpid(pid, NULL, 0);
+	disablelinebuffering();
+	inputresume();
+	if (debug & DEBUGESCAPE)
+		fprintf(logescape, "]\n");
+}
+
+/*
+ * delete the script containing the program to run
+ */
+void deletescript(int warn) {
+	char buf[40];
+	sprintf(buf, "%s/.scrollback.%d", getenv("HOME"), vtno);
+	if (-1 == unlink(buf) && warn)
+		perror(buf);
+}
+
+/*
+ * the scrollback buffer
+ */
+int buffersize;
+u_int32_t *buffer;
+int origin;		/* start of region storing a copy of the screen */
+int show;		/* start of region that is shown when scrolling */
+char *wrapped;		/* whether each row continues on the next */
+int wrappedrows;	/* number of rows in wrapped */
+
+/*
+ * time of each row: a base for each block of rows, then a delta for each row
+ */
+#define TIMEBLOCK 256		/* rows in a block */
+#define TIMELEN 24		/* length of a time in the saved lines */
+struct timeblock {
+	int block;		/* number of the block, -1 if none */
+	long long base;		/* date of its first row, in milliseconds */
+	u_int32_t delta[TIMEBLOCK];	/* date of each row after base */
+} *timeblocks;
+int timeslots;		/* blocks in timeblocks */
+int timestamps;		/* the saved lines start with their time */
+int showtimes;		/* show the time of the rows when scrolling */
+int timedcell;		/* start of the row timed by its first character */
+int jumping;		/* the keys typed are the minutes to go back */
+int jumpminutes;
+
+/*
+ * record the date a row is started
+ */
+void timestamprow(int r, long long now) {
+	struct timeblock *t;
+
+	t = &timeblocks[r / TIMEBLOCK % timeslots];
+	if (t->block != r / TIMEBLOCK) {
+		t->block = r / TIMEBLOCK;
+		t->base = now;
+	}
+	t->delta[r % TIMEBLOCK] = now < t->base ? 0 :
+		now - t->base < 0xFFFFFFFF ? now - t->base : 0xFFFFFFFF;
+}
+
+/*
+ * date of a row, -1 if not known
+ */
+long long rowtime(int r) {
+	struct timeblock *t;
+
+	t = &timeblocks[r / TIMEBLOCK % timeslots];
+	if (t->block != r / TIMEBLOCK)
+		return -1;
+	return t->base + t->delta[r % TIMEBLOCK];
+}
+
+/*
+ * time of a row at the start of a saved line
+ */
+int timeprefix(char *dest, int r) {
+	long long t;
+
+	t = rowtime(r);
+	if (t == -1)
+		return sprintf(dest, "%*s", TIMELEN, "");
+	timeformat(dest, t);
+	dest[TIMELEN - 1] = ' ';
+	return TIMELEN;
+}
+
+/*
+ * snapshots of the screen: the last one is in snapshotscreen, each one
+ * before is stored as the changes that turn the next into it
+ */
+#define SNAPSHOTINTERVAL 10	/* seconds between snapshots, at least */
+#define SNAPSHOTS 4096		/* snapshots kept, at most */
+#define SNAPSHOTDATA (1024 * 1024)	/* bytes of changes kept, at most */
+struct snapshot {
+	long long start;	/* changes, in snapshotdata */
+	int len;
+	long long date;		/* when the screen was last seen so */
+} snapshots[SNAPSHOTS];
+int snapshotfirst, snapshotlast;	/* the snapshots, in a ring */
+unsigned char snapshotdata[SNAPSHOTDATA];	/* their changes, in a ring */
+long long snapshotend;	/* bytes of changes stored so far */
+u_int32_t *snapshotscreen;	/* the screen at the last snapshot */
+long long snapshotdate;	/* when it was last seen */
+long long nextsnapshot;	/* microseconds */
+unsigned char *snapshotchanges;	/* changes being made */
+u_int32_t *snapshotview;	/* the screen shown */
+int snapshotshown;	/* snapshots back from the last, 0 if none shown */
+int snapshottop;	/* first row of it shown */
+
+/*
+ * background save
+ */
+pid_t savepid;		/* process saving the buffer, 0 if none */
+long long savestart;	/* when it started */
+char *savenotice;	/* result to show when scrolling back, or NULL */
+
+/*
+ * search in the scrollback buffer
+ */
+#define SEARCHLEN 80
+int searching;		/* the keys typed are the string to search */
+char searchkeys[SEARCHLEN];	/* the string to search, as typed */
+int searchkeyslen;
+u_int32_t searchstring[SEARCHLEN];	/* the same, as cells */
+int searchlen;
+int searchfrom;		/* last cell where the string may start */
+int searchhit;		/* where it was found, -1 if not */
+int searchhitlen;	/* length of what was found */
+int searchregex;	/* a regular expression, -1 if an invalid one */
+
+/*
+ * index of the trigrams in each block of the scrollback buffer
+ */
+#define INDEXBLOCK (64 * 1024)	/* cells in a block */
+#define INDEXBITS (64 * 1024)	/* bits in the filter of a block */
+struct indexblock {
+	int block;		/* number of the block, -1 if none */
+	unsigned char filter[INDEXBITS / 8];
+} *indexblocks;
+int indexslots;		/* blocks in the index */
+int indexed;		/* trigrams starting before this cell are indexed */
+int indexlow;		/* the blocks before this cell are not indexed */
+
+/*
+ * journal of the rows scrolled out of the screen
+ */
+#define JOURNALINTERVAL 1	/* seconds between writes and syncs */
+#define JOURNALBATCH (1024 * 1024)	/* bytes that make an early write */
+char *journalpath;	/* file, NULL for no journal */
+int journalfile;
+pthread_t journalthread;
+char *journalfill;	/* rows to write, appended by the recorder */
+int journalfilllen, journalfillsize;
+char *journalwrite;	/* rows being written by the journal thread */
+int journalwritesize;
+int journalrequest;	/* writes requested by the main thread */
+int journalserved;	/* of them, the ones done */
+int journalquit;
+int journalwrapped;	/* last row written continues on the next */
+unsigned short *journalattrs;	/* attributes of the row being written */
+pthread_mutex_t journalmutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t journalwork = PTHREAD_COND_INITIALIZER;
+pthread_cond_t journaldone = PTHREAD_COND_INITIALIZER;
+
+/*
+ * control socket
+ */
+#define CONTROLPATH (LOGDIR "/scrollback.%d")
+#define CONTROLCLIENTS 16
+#define CONTROLLINE 256		/* maximal length of a request */
+#define CONTROLCHECK 1024	/* rows between checks for overwriting */
+int control;		/* whether to open the control socket */
+char controlpath[4096];
+int controlsocket;	/* -1 if none */
+int controlepoll;	/* epoll of the control thread */
+int controlevent;	/* eventfd: rows retired, or quit */
+int controlquit;
+int controlfollowers;	/* clients waiting for new rows */
+int retiredrows;	/* rows scrolled out, as applied by the recorder */
+int rowbase;		/* added to the rows of the buffer to number them */
+pthread_t controlthread;
+pthread_mutex_t controlmutex = PTHREAD_MUTEX_INITIALIZER;	/* geometry */
+struct controlclient {
+	int fd;			/* -1 if free */
+	char line[CONTROLLINE];	/* request received so far */
+	int len;
+	int follow;		/* next row to send, -1 if not following */
+	char *out;		/* allocation holding unsent, or NULL */
+	char *unsent;		/* answer the socket did not take yet */
+	size_t unsentlen;
+} controlclient[CONTROLCLIENTS];
+struct geometry {
+	int number;		/* the value of geometry when copied */
+	u_int32_t *buffer;
+	int buffersize;
+	char *wrapped;
+	int wrappedrows;
+	int rows, cols;
+	int renumbered;		/* the value of renumbered when copied */
+	int top;		/* first row numbered after the last resize */
+	int base;		/* the value of rowbase when copied */
+};
+u_int32_t *controlbuffer;	/* buffer read by the control thread, or NULL */
+u_int32_t *orphanbuffer;	/* replaced while read, freed by the thread */
+char *orphanwrapped;
+char *controldata;	/* rows encoded by the control thread */
+u_int32_t *controlcells;	/* a row copied from the buffer */
+int controlcols;	/* the width these are allocated for */
+
+/*
+ * append a row to the journal and to the index (forward declarations)
+ */
+void journalrow(int pos, int row, int wrap);
+void indexrow(int row);
+
+/*
+ * recorder thread
+ */
+pthread_t recorderthread;
+struct record {
+	u_int32_t pos;		/* cell, or first cell if RECORD_CLEAR */
+	u_int32_t value;	/* character, number of cells, row */
+};
+#define RECORD_CLEAR 0x80000000
+#define RECORD_SCROLL 0x40000000	/* the row at pos scrolled out */
+#define MAXBUFFER (INT_MAX / 4)	/* cells in the buffer, below the flags */
+#define RECORD_WRAPPED 0x80000000	/* in the value, the row wrapped */
+#define RECORDRING (64 * 1024)
+struct record recordring[RECORDRING];
+unsigned recordhead	/* written by the main thread */
+	__attribute__((aligned(64)));
+unsigned recordtail	/* applied by the recorder thread */
+	__attribute__((aligned(64)));
+int recordidle;		/* the recorder is waiting for records */
+int recordwaiting;	/* the main thread is waiting for the recorder */
+int recordquit;
+pthread_mutex_t recordmutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t recordwork = PTHREAD_COND_INITIALIZER;
+pthread_cond_t recorddone = PTHREAD_COND_INITIALIZER;
+
+/*
+ * recorder thread: apply the records to the scrollback buffer
+ */
+void *recorderloop(void *arg) {
+	unsigned head, tail, pos, i;
+	struct record *r;
+	int journaling, scrolled;
+
+	(void) arg;
+	tail = recordtail;
+	for (;;) {
+		head = __atomic_load_n(&recordhead, __ATOMIC_ACQUIRE);
+		if (head == tail) {
+			pthread_mutex_lock(&recordmutex);
+			__atomic_store_n(&recordidle, 1, __ATOMIC_SEQ_CST);
+			while (__atomic_load_n(&recordhead, __ATOMIC_SEQ_CST) ==
+			       tail && ! recordquit)
+				pthread_cond_wait(&recordwork, &recordmutex);
+			__atomic_store_n(&recordidle, 0, __ATOMIC_SEQ_CST);
+			if (recordquit && recordhead == tail) {
+				pthread_mutex_unlock(&recordmutex);
+				break;
+			}
+			pthread_mutex_unlock(&recordmutex);
+			continue;
+		}
+
+		journaling = 0;
+		scrolled = 0;
+		for (; tail != head; tail++) {
+			r = &recordring[tail % RECORDRING];
+			if (! (r->pos & (RECORD_CLEAR | RECORD_SCROLL))) {
+				buffer[r->pos] = r->value;
+				continue;
+			}
+			if (r->pos & RECORD_SCROLL) {
+				__atomic_store_n(&retiredrows,
+					(r->value & ~RECORD_WRAPPED) + 1 +
+					__atomic_load_n(&rowbase,
+						__ATOMIC_RELAXED),
+					__ATOMIC_SEQ_CST);
+				scrolled = 1;
+				indexrow(r->value & ~RECORD_WRAPPED);
+				if (journalfile == -1)
+					continue;
+				if (! journaling)
+					pthread_mutex_lock(&journalmutex);
+				journaling = 1;
+				journalrow(r->pos & ~RECORD_SCROLL,
+					r->value & ~RECORD_WRAPPED,
+					!! (r->value & RECORD_WRAPPED));
+				continue;
+			}
+			pos = r->pos & ~RECORD_CLEAR;
+			for (i = 0; i < r->value; i++) {
+				if (pos >= (unsigned) buffersize)
+					pos = 0;
+				buffer[pos++] = ' ';
+			}
+		}
+		if (journaling)
+			pthread_mutex_unlock(&journalmutex);
+		if (scrolled &&
+		    __atomic_load_n(&controlfollowers, __ATOMIC_RELAXED) > 0)
+			eventfd_write(controlevent, 1);
+		if (debug & DEBUGBUFFER) {
+			fseek(logbuffer, 0, SEEK_SET);
+			fwrite(buffer, sizeof(u_int32_t), buffersize,
+				logbuffer);
+		}
+		__atomic_store_n(&recordtail, tail, __ATOMIC_SEQ_CST);
+
+		if (__atomic_load_n(&recordwaiting, __ATOMIC_SEQ_CST)) {
+			pthread_mutex_lock(&recordmutex);
+			pthread_cond_broadcast(&recorddone);
+			pthread_mutex_unlock(&recordmutex);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * wake the recorder thread if it waits for records
+ */
+void recordkick() {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (! __atomic_load_n(&recordidle, __ATOMIC_SEQ_CST))
+		return;
+	pthread_mutex_lock(&recordmutex);
+	pthread_cond_signal(&recordwork);
+	pthread_mutex_unlock(&recordmutex);
+}
+
+/*
+ * append a record for the recorder thread
+ */
+void record(u_int32_t pos, u_int32_t value) {
+	struct record *r;
+
+	while (recordhead - __atomic_load_n(&recordtail, __ATOMIC_ACQUIRE) >=
+	       RECORDRING) {
+		recordkick();
+		sched_yield();
+	}
+	r = &recordring[recordhead % RECORDRING];
+	r->pos = pos;
+	r->value = value;
+	__atomic_store_n(&recordhead, recordhead + 1, __ATOMIC_RELEASE);
+}
+void recordcell(int pos, u_int32_t c) {
+	record(pos, c);
+}
+void recordclear(int start, int len) {
+	record((start % buffersize) | RECORD_CLEAR, len);
+}
+
+/*
+ * wait until the scrollback buffer contains all records
+ */
+void recordsync() {
+	if (__atomic_load_n(&recordtail, __ATOMIC_ACQUIRE) == recordhead)
+		return;
+	pthread_mutex_lock(&recordmutex);
+	__atomic_store_n(&recordwaiting, 1, __ATOMIC_SEQ_CST);
+	pthread_cond_signal(&recordwork);
+	while (__atomic_load_n(&recordtail, __ATOMIC_SEQ_CST) != recordhead)
+		pthread_cond_wait(&recorddone, &recordmutex);
+	__atomic_store_n(&recordwaiting, 0, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&recordmutex);
+}
+
+/*
+ * start and stop the recorder thread
+ */
+int recorderstart() {
+	recordhead = 0;
+	recordtail = 0;
+	recordidle = 0;
+	recordwaiting = 0;
+	recordquit = 0;
+	return pthread_create(&recorderthread, NULL, recorderloop, NULL) ?
+		-1 : 0;
+}
+void recorderstop() {
+	pthread_mutex_lock(&recordmutex);
+	recordquit = 1;
+	pthread_cond_signal(&recordwork);
+	pthread_mutex_unlock(&recordmutex);
+	pthread_join(recorderthread, NULL);
+}
+
+/*
+ * the screen
+ */
+struct winsize winsize;	/* screen size */
+int row, col;		/* position of the cursor */
+int positionstatus;	/* is the cursor position known? */
+#define POSITION_UNKNOWN   0
+#define POSITION_KNOWN     1
+#define POSITION_UNCERTAIN 2
+
+/*
+ * change of the screen size
+ */
+int resized;		/* SIGWINCH received */
+int geometry;		/* number of changes, for the control thread */
+int renumbered;		/* number of resizes, for the control thread */
+int renumberedtop;	/* first row numbered after the last resize */
+int reflowing;		/* the reflow thread is running */
+int reflowlow;		/* the rows from this cell on are in the buffer */
+int reflowwriting;	/* the reflow thread writes from this cell on */
+int reflowlimit;	/* the reflow thread may not write below this cell */
+int reflowquit;
+int reflowevent;	/* eventfd: the reflow thread is done */
+pthread_t reflowthread;
+
+/*
+ * change of the buffer size
+ */
+int bufferrequest;	/* cells asked for, 0 if none */
+int bufferevent;	/* eventfd: the control thread asked for a size */
+int sizing;		/* the keys typed are the rows of the new buffer */
+int sizingrows;
+
+/*
+ * first cell of the buffer not overwritten
+ */
+int bufferlow() {
+	int low, reflowed;
+
+	low = origin - (buffersize - winsize.ws_row * winsize.ws_col) /
+		winsize.ws_col * winsize.ws_col;
+	reflowed = __atomic_load_n(&reflowlow, __ATOMIC_ACQUIRE);
+	if (low < reflowed)
+		low = reflowed;
+	return low < 0 ? 0 : low;
+}
+
+/*
+ * output floods
+ */
+int framerate;		/* frames per second when flooding, 0 = never flood */
+int flood;		/* characters are not sent to the terminal */
+#define FLOOD_NONE      0
+#define FLOOD_RATE      1
+#define FLOOD_INTERRUPT 2
+int interrupted;	/* interrupt character typed */
+u_int32_t *shadow;	/* what the terminal shows, when flooding */
+int shadoworigin;	/* origin when the shadow copy was last updated */
+long long nextframe;	/* when to draw the next frame */
+char floodattributes[SEQUENCELEN * 4];	/* attributes not sent yet */
+#define FLOODTHRESHOLD 1024
+#define NOCELL 0xFFFFFFFF
+
+/*
+ * synchronized output
+ */
+int synchronized;	/* between begin and end of synchronized output */
+#define SYNCTIMEOUT 200000
+
+/*
+ * begin and end synchronized output
+ */
+void beginsynchronized() {
+	if (debug & DEBUGESCAPE)
+		fprintf(logescape, "[beginsynchronized]");
+	if (! synchronized)
+		armtimer(flushtimer, SYNCTIMEOUT);
+	synchronized = 1;
+}
+void endsynchronized(int timeout) {
+	if (debug & DEBUGESCAPE)
+		fprintf(logescape, "[endsynchronized(%d)]", timeout);
+	if (! synchronized)
+		return;
+	synchronized = 0;
+	armtimer(flushtimer, 0);
+	outputflush();
+	stats.syncframes++;
+	if (timeout)
+		stats.synctimeouts++;
+}
+
+/*
+ * colors and attributes: each distinct set of them is stored once in
+ * attributetable[]; the cells of the screen have their set in screenattr[], a
+ * ring of rows starting at screentop; when a row scrolls out, its changes of
+ * set are appended to spans[] and its cells in screenattr[] are cleared
+ */
+#define ATTRIBUTES 4096		/* distinct sets, at most */
+#define SGRLEN 64		/* length of a sequence setting them, at most */
+#define ATTRIBUTE_BOLD      0x01
+#define ATTRIBUTE_FAINT     0x02
+#define ATTRIBUTE_ITALIC    0x04
+#define ATTRIBUTE_UNDERLINE 0x08
+#define ATTRIBUTE_BLINK     0x10
+#define ATTRIBUTE_REVERSE   0x20
+#define ATTRIBUTE_STRIKE    0x40
+#define COLOR_RGB 0x1000000	/* 0 = default, 1-256 = palette, or rgb */
+struct attribute {
+	u_int32_t fg, bg;
+	int flags;
+} attributetable[ATTRIBUTES];
+int attributecount;	/* sets in attributetable, the first is none */
+unsigned short attributehash[ATTRIBUTES * 2];	/* index + 1, 0 if none */
+struct attribute current;	/* the set of the shell output */
+int attribute;		/* its index in attributetable */
+unsigned short *screenattr;	/* set of each cell of the screen */
+char *rowcolored;	/* a row of screenattr is not all zero */
+int coloredrows;	/* rows of screenattr not all zero */
+int screentop;		/* row of screenattr of the first row of the screen */
+struct span {
+	int row;		/* row, counted from the start */
+	unsigned short col;	/* first cell */
+	unsigned short attr;	/* set from that cell on */
+} *spans;
+int spanslots;		/* size of spans */
+int spanfirst, spanlast;	/* the spans, in a ring */
+int spanrows;		/* rows scrolled out, their attributes in spans */
+unsigned short *rowattrs;	/* sets of the cells of a row, main thread */
+int colors;		/* the saved lines include the colors */
+
+/*
+ * index of a set of attributes, adding it if new; 0 if there is no room
+ */
+int attributeindex(struct attribute *a) {
+	unsigned h;
+	struct attribute *t;
+
+	h = (a->fg * 31 + a->bg * 17 + a->flags) % (ATTRIBUTES * 2);
+	for (; attributehash[h] != 0; h = (h + 1) % (ATTRIBUTES * 2)) {
+		t = &attributetable[attributehash[h] - 1];
+		if (t->fg == a->fg && t->bg == a->bg && t->flags == a->flags)
+			return attributehash[h] - 1;
+	}
+	if (attributecount == ATTRIBUTES) {
+		stats.attributeslost++;
+		return 0;
+	}
+	attributetable[attributecount] = *a;
+	attributehash[h] = ++attributecount;
+	return attributecount - 1;
+}
+
+/*
+ * change the attributes by the parameters of a SGR sequence, like 1;31
+ */
+void setattributes(char *params) {
+	int args[32], n, i, j;
+	u_int32_t color;
+	char *end;
+
+	for (n = 0; n < 32; n++) {
+		args[n] = strtol(params, &end, 10);
+		if (*end != ';' && *end != ':')
+			break;
+		params = end + 1;
+	}
+	for (i = 0; i <= n && i < 32; i++)
+		switch (args[i]) {
+		case 0:
+			current.fg = 0;
+			current.bg = 0;
+			current.flags = 0;
+			break;
+		case 1:
+			current.flags |= ATTRIBUTE_BOLD;
+			break;
+		case 2:
+			current.flags |= ATTRIBUTE_FAINT;
+			break;
+		case 3:
+			current.flags |= ATTRIBUTE_ITALIC;
+			break;
+		case 4:
+			current.flags |= ATTRIBUTE_UNDERLINE;
+			break;
+		case 5:
+			current.flags |= ATTRIBUTE_BLINK;
+			break;
+		case 7:
+			current.flags |= ATTRIBUTE_REVERSE;
+			break;
+		case 9:
+			current.flags |= ATTRIBUTE_STRIKE;
+			break;
+		case 21:
+		case 22:
+			current.flags &= ~(ATTRIBUTE_BOLD | ATTRIBUTE_FAINT);
+			break;
+		case 23:
+			current.flags &= ~ATTRIBUTE_ITALIC;
+			break;
+		case 24:
+			current.flags &= ~ATTRIBUTE_UNDERLINE;
+			break;
+		case 25:
+			current.flags &= ~ATTRIBUTE_BLINK;
+			break;
+		case 27:
+			current.flags &= ~ATTRIBUTE_REVERSE;
+			break;
+		case 29:
+			current.flags &= ~ATTRIBUTE_STRIKE;
+			break;
+		case 38:
+		case 48:
+			j = i;
+			color = 0;
+			if (i + 2 <= n && args[i + 1] == 5) {
+				color = 1 + (args[i + 2] & 0xFF);
+				i += 2;
+			}
+			else if (i + 4 <= n && args[i + 1] == 2) {
+				color = COLOR_RGB | (args[i + 2] & 0xFF) << 16 |
+					(args[i + 3] & 0xFF) << 8 |
+					(args[i + 4] & 0xFF);
+				i += 4;
+			}
+			if (args[j] == 38)
+				current.fg = color;
+			else
+				current.bg = color;
+			break;
+		case 39:
+			current.fg = 0;
+			break;
+		case 49:
+			current.bg = 0;
+			break;
+		default:
+			if (args[i] >= 30 && args[i] <= 37)
+				current.fg = 1 + args[i] - 30;
+			else if (args[i] >= 40 && args[i] <= 47)
+				current.bg = 1 + args[i] - 40;
+			else if (args[i] >= 90 && args[i] <= 97)
+				current.fg = 1 + args[i] - 90 + 8;
+			else if (args[i] >= 100 && args[i] <= 107)
+				current.bg = 1 + args[i] - 100 + 8;
+		}
+	attribute = attributeindex(&current);
+}
+
+/*
+ * a color in a sequence setting attributes
+ */
+int sgrcolor(char *dest, int base, u_int32_t color) {
+	if (color & COLOR_RGB)
+		return sprintf(dest, ";%d;2;%d;%d;%d", base + 8,
+			color >> 16 & 0xFF, color >> 8 & 0xFF, color & 0xFF);
+	color--;
+	if (color < 8)
+		return sprintf(dest, ";%d", base + color);
+	if (color < 16)
+		return sprintf(dest, ";%d", base + 60 + color - 8);
+	return sprintf(dest, ";%d;5;%d", base + 8, color);
+}
+
+/*
+ * sequence changing the attributes from a set to another, empty if equal
+ */
+int sgrformat(char *dest, int from, int index) {
+	struct attribute *a, *p;
+	char *d;
+	int i, removed, added;
+	static int codes[] = {1, 2, 3, 4, 5, 7, 9};
+	static int resets[] = {22, 22, 23, 24, 25, 27, 29};
+
+	p = &attributetable[from];
+	a = &attributetable[index];
+	d = dest + 1;
+	removed = p->flags & ~a->flags;
+	added = a->flags & ~p->flags;
+	if (removed & (ATTRIBUTE_BOLD | ATTRIBUTE_FAINT)) {
+		d += sprintf(d, ";22");
+		added |= a->flags & (ATTRIBUTE_BOLD | ATTRIBUTE_FAINT);
+	}
+	for (i = 2; i < 7; i++)
+		if (removed & (1 << i))
+			d += sprintf(d, ";%d", resets[i]);
+	for (i = 0; i < 7; i++)
+		if (added & (1 << i))
+			d += sprintf(d, ";%d", codes[i]);
+	if (a->fg != p->fg)
+		d += a->fg == 0 ? sprintf(d, ";39") : sgrcolor(d, 30, a->fg);
+	if (a->bg != p->bg)
+		d += a->bg == 0 ? sprintf(d, ";49") : sgrcolor(d, 40, a->bg);
+	if (d == dest + 1)
+		return 0;
+	dest[0] = '\033';
+	dest[1] = '[';
+	*d++ = 'm';
+	*d = '\0';
+	return d - dest;
+}
+
+/*
+ * the attributes of a cell of the screen are the current ones
+ */
+void colorcell(int r, int c) {
+	r += screentop;
+	if (r >= winsize.ws_row)
+		r -= winsize.ws_row;
+	if (attribute == 0 && ! rowcolored[r])
+		return;
+	if (! rowcolored[r]) {
+		rowcolored[r] = 1;
+		coloredrows++;
+	}
+	screenattr[r * winsize.ws_col + c] = attribute;
+}
+
+/*
+ * drop the attributes of some cells of a row of the screen
+ */
+void uncolor(int r, int start, int end) {
+	r += screentop;
+	if (r >= winsize.ws_row)
+		r -= winsize.ws_row;
+	if (! rowcolored[r] || end <= start)
+		return;
+	memset(screenattr + r * winsize.ws_col + start, 0,
+		(end - start) * sizeof(unsigned short));
+	if (start == 0 && end == winsize.ws_col) {
+		rowcolored[r] = 0;
+		coloredrows--;
+	}
+}
+
+/*
+ * the first row of the screen scrolls out: store its attributes as spans;
+ * done before the row is passed to the recorder, which may journal it
+ */
+void colorscroll() {
+	unsigned short *attrs, a;
+	int c;
+	struct span *s;
+
+	if (rowcolored[screentop]) {
+		attrs = screenattr + screentop * winsize.ws_col;
+		for (c = 0, a = 0; c < winsize.ws_col; c++) {
+			if (attrs[c] == a)
+				continue;
+			a = attrs[c];
+			if (spanlast - spanfirst == spanslots)
+				spanfirst++;
+			s = &spans[spanlast++ % spanslots];
+			s->row = spanrows;
+			s->col = c;
+			s->attr = a;
+		}
+		uncolor(0, 0, winsize.ws_col);
+	}
+	screentop = screentop + 1 < winsize.ws_row ? screentop + 1 : 0;
+	spanrows++;
+}
+
+/*
+ * first span of a row or later
+ */
+int spanafter(int r) {
+	int low, high, mid;
+
+	low = spanfirst;
+	high = spanlast;
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (spans[mid % spanslots].row < r)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+/*
+ * the attributes of each cell of a row; 0 if none has any
+ */
+int rowattributes(int r, unsigned short *attrs) {
+	int screen, i, c;
+	unsigned short a;
+
+	screen = spanrows;
+	if (r >= screen) {
+		if (r - screen >= winsize.ws_row)
+			return 0;
+		r = (screentop + r - screen) % winsize.ws_row;
+		if (! rowcolored[r])
+			return 0;
+		memcpy(attrs, screenattr + r * winsize.ws_col,
+			winsize.ws_col * sizeof(unsigned short));
+		return 1;
+	}
+	i = spanafter(r);
+	if (i >= spanlast || spans[i % spanslots].row != r)
+		return 0;
+	for (c = 0, a = 0; i < spanlast && spans[i % spanslots].row == r; i++) {
+		for (; c < spans[i % spanslots].col; c++)
+			attrs[c] = a;
+		a = spans[i % spanslots].attr;
+	}
+	for (; c < winsize.ws_col; c++)
+		attrs[c] = a;
+	return 1;
+}
+
+/*
+ * bytes of the sequences setting the attributes of some rows, at most
+ */
+long long colorbytes(int r, int rows) {
+	long long n;
+
+	if (! colors)
+		return 0;
+	n = spanafter(r + rows) - spanafter(r) + rows;
+	if (r + rows > spanrows)
+		n += winsize.ws_row * winsize.ws_col;
+	return n * SGRLEN;
+}
+
+/*
+ * move to the status area in the bottom line; return its length, which
+ * is less than the rest of the line so that it does not wrap
+ */
+int statusarea() {
+	int col;
+
+	col = winsize.ws_col - 42 < 38 ? winsize.ws_col - 42 : 38;
+	if (col < 1)
+		col = 1;
+	outputformat("\033[%d;%dH", winsize.ws_row + 1, col);
+	return winsize.ws_col - col < 42 ? winsize.ws_col - col : 42;
+}
+
+/*
+ * message to the user when scrolling
+ */
+void notify(char *message) {
+	int len;
+
+	len = statusarea();
+	outputformat("%.*s" ERASECURSORLINE, len - 1, message);
+	outputflush();
+}
+
+/*
+ * print a character of the scrollback buffer
+ */
+void printcell(u_int32_t c, u_int32_t prev) {
+	char buf[10];
+	if (singlechar) {
+		if (prev >= 0xC0 && c >= 0x80 && c < 0xC0)
+			outputchar(DEL);
+		outputchar(c);
+	}
+	else {
+		ucs4toutf8(c, buf);
+		outputstring(buf);
+	}
+}
+
+/*
+ * print consecutive cells of the scrollback buffer
+ */
+void printcells(u_int32_t *cells, int n) {
+	int i;
+
+	if (singlechar)
+		for (i = 0; i < n; i++)
+			printcell(cells[i], i == 0 ? 0 : cells[i - 1]);
+	else
+		outputlen += ucs4toutf8block(outputspace(n * 4), cells, n);
+}
+
+/*
+ * print cells of the scrollback buffer, from any position
+ */
+void printrange(int pos, int n) {
+	if (pos + n <= buffersize)
+		printcells(buffer + pos, n);
+	else {
+		printcells(buffer + pos, buffersize - pos);
+		printcells(buffer, n - (buffersize - pos));
+	}
+}
+
+/*
+ * print rows of the scrollback buffer with their attributes
+ */
+void printrows(int start, int size) {
+	int r, pos, c, e;
+
+	if (coloredrows == 0 && spanfirst == spanlast) {
+		printrange(start % buffersize, size);
+		return;
+	}
+	r = start / winsize.ws_col;
+	for (; size > 0; size -= winsize.ws_col, start += winsize.ws_col, r++) {
+		pos = start % buffersize;
+		if (! rowattributes(r, rowattrs)) {
+			printrange(pos, winsize.ws_col);
+			continue;
+		}
+		for (c = 0; c < winsize.ws_col; c = e) {
+			for (e = c + 1; e < winsize.ws_col; e++)
+				if (rowattrs[e] != rowattrs[c])
+					break;
+			outputlen += sgrformat(outputspace(SGRLEN),
+				c > 0 ? rowattrs[c - 1] : 0, rowattrs[c]);
+			printrange((pos + c) % buffersize, e - c);
+		}
+		outputstring(RESETATTRIBUTES);
+	}
+}
+
+/*
+ * show the string to search in the status line
+ */
+void searchprompt() {
+	char prompt[SEARCHLEN + 30];
+	int len;
+
+	len = statusarea();
+	snprintf(prompt, sizeof(prompt), "search: %.*s%s",
+		searchkeyslen, searchkeys,
+		searchregex == -1 ? " (bad expression)" :
+		searchhit == -1 && searchlen > 0 ? " (not found)" : "");
+	outputformat("%.*s" ERASECURSORLINE, len - 1, prompt);
+}
+
+/*
+ * show the time of the first and the last row on screen
+ */
+void timebar(int first, int last) {
+	char from[TIMELEN], to[TIMELEN];
+
+	outputstring(ERASECURSORLINE);
+	timezoneupdate();
+	if (rowtime(first) == -1 || rowtime(last) == -1)
+		return;
+	timeformat(from, rowtime(first));
+	timeformat(to, rowtime(last));
+	outputformat(MOVECURSOR "%s to %s", 1, 20,
+		from, strncmp(from, to, 11) ? to : to + 11);
+}
+
+/*
+ * show the minutes to go back in the status line
+ */
+void jumpprompt() {
+	char prompt[40];
+	int len;
+
+	len = statusarea();
+	snprintf(prompt, sizeof(prompt), "minutes ago: %d", jumpminutes);
+	outputformat("%.*s" ERASECURSORLINE, len - 1, prompt);
+}
+
+/*
+ * show the rows of the new buffer in the status line
+ */
+void sizeprompt() {
+	char prompt[60];
+	int len;
+
+	len = statusarea();
+	snprintf(prompt, sizeof(prompt), "buffer rows: %d (now %d)",
+		sizingrows, buffersize / winsize.ws_col);
+	outputformat("%.*s" ERASECURSORLINE, len - 1, prompt);
+}
+
+/*
+ * show a segment of the scrollback buffer on screen
+ */
+#define BARUP   "       " BLUEBACKGROUND "↑↑↑↑↑↑↑↑↑" NORMALBACKGROUND
+#define BARDOWN "       " BLUEBACKGROUND "↓↓↓↓↓↓↓↓↓" NORMALBACKGROUND
+void showscrollback() {
+	int size, start, i;
+
+	recordsync();
+	size = (winsize.ws_row - (show == origin ? 0 : 2)) * winsize.ws_col;
+	outputstring(MAKECURSORINVISIBLE HOMEPOSITION RESETATTRIBUTES);
+	if (show != origin) {
+		if (show - winsize.ws_col >= bufferlow())
+			outputstring(BARUP);
+		if (showtimes)
+			timebar(show / winsize.ws_col,
+				show / winsize.ws_col + winsize.ws_row - 3);
+		outputstring(ERASECURSORLINE "\r\n");
+	}
+	printrows(show, size);
+	if (show != origin) {
+		outputformat(BARDOWN "   %d lines below" ERASECURSORLINE,
+			(origin - show) / winsize.ws_col + 2);
+		notify("F2=save F3=less F4=search");
+		if (savenotice != NULL) {
+			notify(savenotice);
+			savenotice = NULL;
+		}
+		if (searching)
+			searchprompt();
+		if (jumping)
+			jumpprompt();
+		if (sizing)
+			sizeprompt();
+		for (i = 0; searchhit != -1 && i < searchhitlen; i++) {
+			start = searchhit + i - show;
+			if (start < 0 || start >= size)
+				continue;
+			if (i == 0 || start % winsize.ws_col == 0)
+				outputformat(REVERSEVIDEO MOVECURSOR,
+					start / winsize.ws_col + 2,
+					start % winsize.ws_col + 1);
+			printcell(buffer[(searchhit + i) % buffersize], 0);
+		}
+		outputstring(RESETATTRIBUTES);
+	}
+	else {
+		searching = 0;
+		searchhit = -1;
+		jumping = 0;
+		sizing = 0;
+		snapshotshown = 0;
+		outputstring(RESTORECURSOR MAKECURSORVISIBLE);
+		outputlen += sgrformat(outputspace(SGRLEN), 0, attribute);
+		if (flood) {
+			for (i = 0; i < size; i++)
+				shadow[i] = buffer[(origin + i) % buffersize];
+			shadoworigin = origin;
+		}
+	}
+	outputflush();
+}
+
+/*
+ * time of the next frame
+ */
+long long framedeadline() {
+	if (framerate == 0 || flood == FLOOD_INTERRUPT)
+		return LLONG_MAX;
+	return microseconds() + 1000000 / framerate;
+}
+
+/*
+ * start dropping the output of the shell
+ */
+void enterflood(int kind) {
+	int size, i;
+
+	if (debug & DEBUGESCAPE)
+		fprintf(logescape, "[enterflood(%d)]", kind);
+
+	if (flood == FLOOD_NONE) {
+		recordsync();
+		size = winsize.ws_row * winsize.ws_col;
+		for (i = 0; i < size; i++)
+			shadow[i] = kind == FLOOD_INTERRUPT ?
+				NOCELL : buffer[(origin + i) % buffersize];
+		shadoworigin = origin;
+		floodattributes[0] = '\0';
+	}
+	flood = kind;
+	nextframe = framedeadline();
+}
+
+/*
+ * update the terminal to the screen region of the scrollback buffer
+ */
+void frame() {
+	int size, scroll, pos, r, c, first, last;
+
+	recordsync();
+	size = winsize.ws_row * winsize.ws_col;
+	scroll = (origin - shadoworigin) / winsize.ws_col;
+	shadoworigin = origin;
+	if (scroll >= winsize.ws_row)
+		for (pos = 0; pos < size; pos++)
+			shadow[pos] = NOCELL;
+	else if (scroll > 0) {
+		outputformat(MOVECURSOR, winsize.ws_row, 1);
+		for (r = 0; r < scroll; r++)
+			outputchar(NL);
+		pos = scroll * winsize.ws_col;
+		memmove(shadow, shadow + pos, (size - pos) * sizeof(u_int32_t));
+		for (pos = size - pos; pos < size; pos++)
+			shadow[pos] = ' ';
+	}
+
+	for (r = 0; r < winsize.ws_row; r++) {
+		pos = r * winsize.ws_col;
+		for (first = 0; first < winsize.ws_col; first++)
+			if (shadow[pos + first] !=
+			    buffer[(origin + pos + first) % buffersize])
+				break;
+		if (first == winsize.ws_col)
+			continue;
+		for (last = winsize.ws_col - 1; last > first; last--)
+			if (shadow[pos + last] !=
+			    buffer[(origin + pos + last) % buffersize])
+				break;
+		outputformat(MOVECURSOR, r + 1, first + 1);
+		for (c = first; c <= last; c++)
+			shadow[pos + c] =
+				buffer[(origin + pos + c) % buffersize];
+		printcells(shadow + pos + first, last - first + 1);
+	}
+
+					/* past the last column: wrap pending */
+	if (col < winsize.ws_col)
+		outputformat(MOVECURSOR, row + 1, col + 1);
+	else {
+		outputformat(MOVECURSOR, row + 1, winsize.ws_col);
+		pos = row * winsize.ws_col + winsize.ws_col - 1;
+		printcell(buffer[(origin + pos) % buffersize], 0);
+	}
+
+	stats.frames++;
+	nextframe = framedeadline();
+}
+
+/*
+ * return forwarding the output of the shell
+ */
+void leaveflood() {
+	if (debug & DEBUGESCAPE)
+		fprintf(logescape, "[leaveflood]");
+	frame();
+	outputstring(floodattributes);
+	flood = FLOOD_NONE;
+}
+
+/*
+ * bytes waiting to be read from a file descriptor
+ */
+int backlog(int fd) {
+	int len;
+	stats.syscalls++;
+	if (ioctl(fd, FIONREAD, &len) == -1)
+		return 0;
+	return len;
+}
+
+/*
+ * parallel encoding of the scrollback buffer; the process saving it is
+ * forked from a process with threads, so it only makes system calls: the
+ * chunks are encoded by processes it forks in turn, in memory allocated
+ * before and shared with it
+ */
+#define SAVEPROCESSES 16
+#define SAVEMINCELLS (1024 * 1024)
+struct savechunk {
+	int start;		/* first cell in the buffer */
+	int row;		/* its row, as counted by wrapped */
+	int cells;		/* number of cells */
+	char *data;		/* encoded cells, in savejob.shared */
+	unsigned short *attrs;	/* attributes of a row, in savejob.shared */
+	pid_t pid;
+};
+struct {
+	int chunks;
+	struct savechunk chunk[SAVEPROCESSES];
+	ssize_t *len;		/* length of the encoded chunks */
+	char *shared;
+	size_t sharedsize;
+} savejob;
+
+/*
+ * encode some cells of the scrollback buffer
+ */
+ssize_t encodecells(char *dest, int pos, int cells) {
+	char *d;
+	int i, n;
+
+	d = dest;
+	while (cells > 0) {
+		if (pos >= buffersize)
+			pos = 0;
+		n = cells < buffersize - pos ? cells : buffersize - pos;
+		if (singlechar)
+			for (i = 0; i < n; i++)
+				*d++ = buffer[pos + i];
+		else
+			d += ucs4toutf8block(d, buffer + pos, n);
+		pos += n;
+		cells -= n;
+	}
+	return d - dest;
+}
+
+/*
+ * encode some rows of the scrollback buffer as lines: trailing blanks are
+ * removed and a newline ends each row, except the rows that wrapped; with
+ * timestamps, each line starts with the time of its first row
+ */
+ssize_t encoderow(char *dest, int pos, int wrap) {
+	ssize_t len;
+	int n;
+
+	n = winsize.ws_col;
+	if (! wrap)
+		while (n > 0 && buffer[(pos + n - 1) % buffersize] == ' ')
+			n--;
+	len = encodecells(dest, pos, n);
+	if (! wrap)
+		dest[len++] = '\n';
+	return len;
+}
+ssize_t encodecolored(char *dest, int pos, int row, int wrap,
+		unsigned short *attrs) {
+	ssize_t len;
+	int n, c, e, set;
+
+	if (attrs == NULL || ! rowattributes(row, attrs))
+		return encoderow(dest, pos, wrap);
+	n = winsize.ws_col;
+	if (! wrap)
+		while (n > 0 && buffer[(pos + n - 1) % buffersize] == ' ')
+			n--;
+	len = 0;
+	set = 0;
+	for (c = 0; c < n; c = e) {
+		for (e = c + 1; e < n; e++)
+			if (attrs[e] != attrs[c])
+				break;
+		if (c > 0 || attrs[c] != 0) {
+			len += sgrformat(dest + len,
+				c > 0 ? attrs[c - 1] : 0, attrs[c]);
+			set = 1;
+		}
+		len += encodecells(dest + len, (pos + c) % buffersize, e - c);
+	}
+	if (set)
+		len += sprintf(dest + len, RESETATTRIBUTES);
+	if (! wrap)
+		dest[len++] = '\n';
+	return len;
+}
+ssize_t encoderows(char *dest, int pos, int row, int cells,
+		unsigned short *attrs) {
+	char *d;
+
+	d = dest;
+	for (; cells > 0; cells -= winsize.ws_col, row++) {
+		if (timestamps &&
+		    (row == 0 || ! wrapped[(row - 1) % wrappedrows]))
+			d += timeprefix(d, row);
+		d += encodecolored(d, pos, row, wrapped[row % wrappedrows],
+			attrs);
+		pos = (pos + winsize.ws_col) % buffersize;
+	}
+	return d - dest;
+}
+
+/*
+ * write all data
+ */
+int writeall(int fd, char *data, ssize_t len) {
+	ssize_t res;
+
+	while (len > 0) {
+		res = write(fd, data, len);
+		if (res == -1 && errno == EINTR)
+			continue;
+		if (res == -1)
+			return -1;
+		data += res;
+		len -= res;
+	}
+	return 0;
+}
+
+/*
+ * encode a chunk of rows
+ */
+void saveworker(int i) {
+	struct savechunk *k;
+
+	k = &savejob.chunk[i];
+	savejob.len[i] = encoderows(k->data, k->start, k->row, k->cells,
+		colors ? k->attrs : NULL);
+}
+
+/*
+ * number of processes for encoding some cells
+ */
+int saveprocesses(int cells) {
+	cpu_set_t set;
+	int n;
+
+	n = sched_getaffinity(0, sizeof(set), &set) == -1 ?
+		1 : CPU_COUNT(&set);
+	if (n > cells / SAVEMINCELLS)
+		n = cells / SAVEMINCELLS;
+	if (n > SAVEPROCESSES)
+		n = SAVEPROCESSES;
+	return n < 1 ? 1 : n;
+}
+
+/*
+ * split cells of the buffer in chunks of rows and allocate the memory for
+ * encoding them, before forking
+ */
+int saveprepare(int start, int cells) {
+	int n, rows, i;
+	struct savechunk *k;
+	size_t size[SAVEPROCESSES], offset;
+
+	n = saveprocesses(cells);
+	rows = cells / winsize.ws_col / n;
+	savejob.chunks = n;
+	offset = SAVEPROCESSES * sizeof(ssize_t);
+	for (i = 0; i < n; i++) {
+		k = &savejob.chunk[i];
+		k->start = (start + i * rows * winsize.ws_col) % buffersize;
+		k->row = start / winsize.ws_col + i * rows;
+		k->cells = i < n - 1 ? rows * winsize.ws_col :
+			cells - i * rows * winsize.ws_col;
+		size[i] = (size_t) k->cells * (singlechar ? 1 : 4) +
+			k->cells / winsize.ws_col *
+				(timestamps ? TIMELEN + 1 : 1) +
+			colorbytes(k->row, k->cells / winsize.ws_col) + 16 +
+			winsize.ws_col * sizeof(unsigned short);
+		size[i] -= size[i] % sizeof(unsigned short);
+		offset += size[i];
+	}
+
+	savejob.sharedsize = offset;
+	savejob.shared = mmap(NULL, savejob.sharedsize, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (savejob.shared == MAP_FAILED)
+		return -1;
+	savejob.len = (ssize_t *) savejob.shared;
+	offset = SAVEPROCESSES * sizeof(ssize_t);
+	for (i = 0; i < n; i++) {
+		k = &savejob.chunk[i];
+		k->attrs = (unsigned short *) (savejob.shared + offset);
+		k->data = savejob.shared + offset +
+			winsize.ws_col * sizeof(unsigned short);
+		offset += size[i];
+	}
+	return 0;
+}
+
+/*
+ * write the cells prepared by saveprepare() to a file, encoding the chunks
+ * in parallel; called in the forked process
+ */
+int savecells(int fd) {
+	int i, status, failed;
+
+	for (i = 1; i < savejob.chunks; i++) {
+		savejob.chunk[i].pid = fork();
+		if (savejob.chunk[i].pid == 0) {
+			saveworker(i);
+			_exit(EXIT_SUCCESS);
+		}
+	}
+	saveworker(0);
+
+	failed = 0;
+	for (i = 1; i < savejob.chunks; i++)
+		if (savejob.chunk[i].pid == -1)
+			saveworker(i);
+		else if (waitpid(savejob.chunk[i].pid, &status, 0) == -1 ||
+		         ! WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed = 1;
+
+	for (i = 0; i < savejob.chunks && ! failed; i++)
+		if (writeall(fd, savejob.chunk[i].data, savejob.len[i]) == -1)
+			failed = 1;
+	return failed ? -1 : 0;
+}
+
+/*
+ * the background save terminated
+ */
+void saved(int status) {
+	savepid = 0;
+	stats.savetime = microseconds() - savestart;
+	savenotice = WIFEXITED(status) && WEXITSTATUS(status) == 0 ?
+		"scrollback buffer saved" : "cannot write file";
+	if (debug & DEBUGESCAPE)
+		fprintf(logescape, "[saved:%s]", savenotice);
+	if (show != origin) {
+		notify(savenotice);
+		savenotice = NULL;
+	}
+}
+
+/*
+ * append a row to the journal; journalmutex is held by the caller
+ */
+void journalrow(int pos, int row, int wrap) {
+	int size;
+	char *fill;
+
+	size = journalfillsize;
+	while (journalfilllen + winsize.ws_col * 4 + 1 + TIMELEN +
+	       (colors ? (winsize.ws_col + 1) * SGRLEN : 0) > size)
+		size = size == 0 ? JOURNALBATCH * 2 : size * 2;
+	if (size != journalfillsize) {
+		fill = realloc(journalfill, size);
+		if (fill == NULL) {
+			stats.journallost++;
+			return;
+		}
+		journalfill = fill;
+		journalfillsize = size;
+	}
+	if (timestamps && ! journalwrapped)
+		journalfilllen += timeprefix(journalfill + journalfilllen, row);
+	journalfilllen += encodecolored(journalfill + journalfilllen,
+		pos, row, wrap, journalattrs);
+	journalwrapped = wrap;
+	if (journalfilllen >= JOURNALBATCH)
+		pthread_cond_signal(&journalwork);
+}
+
+/*
+ * journal thread: write the rows every JOURNALINTERVAL seconds, or earlier if
+ * they are many or requested
+ */
+void *journalloop(void *arg) {
+	struct timespec deadline;
+	time_t synced;
+	char *swap;
+	int size, len, request, quit, dirty;
+
+	(void) arg;
+	synced = 0;
+	dirty = 0;
+	for (;;) {
+		pthread_mutex_lock(&journalmutex);
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += JOURNALINTERVAL;
+		while (! journalquit && journalrequest == journalserved &&
+		       journalfilllen < JOURNALBATCH)
+			if (pthread_cond_timedwait(&journalwork, &journalmutex,
+			                           &deadline) == ETIMEDOUT)
+				break;
+		swap = journalwrite;
+		journalwrite = journalfill;
+		journalfill = swap;
+		size = journalwritesize;
+		journalwritesize = journalfillsize;
+		journalfillsize = size;
+		len = journalfilllen;
+		journalfilllen = 0;
+		request = journalrequest;
+		quit = journalquit;
+		pthread_mutex_unlock(&journalmutex);
+
+		if (len > 0) {
+			if (writeall(journalfile, journalwrite, len) == -1)
+				stats.journallost += len;
+			else
+				stats.journalbytes += len;
+		}
+		if (len > 0)
+			dirty = 1;
+		if (dirty && (quit || request != journalserved ||
+		    time(NULL) - synced >= JOURNALINTERVAL)) {
+			fdatasync(journalfile);
+			stats.journalsyncs++;
+			synced = time(NULL);
+			dirty = 0;
+		}
+
+		pthread_mutex_lock(&journalmutex);
+		journalserved = request;
+		pthread_cond_broadcast(&journaldone);
+		pthread_mutex_unlock(&journalmutex);
+		if (quit)
+			break;
+	}
+	return NULL;
+}
+
+/*
+ * start and stop the journal thread
+ */
+int journalstart() {
+	journalfile = -1;
+	if (journalpath == NULL)
+		return 0;
+	journalfile = open(journalpath,
+		O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (journalfile == -1)
+		return -1;
+	journalrequest = 0;
+	journalserved = 0;
+	journalquit = 0;
+	journalattrs = colors ?
+		malloc(winsize.ws_col * sizeof(unsigned short)) : NULL;
+	if (pthread_create(&journalthread, NULL, journalloop, NULL)) {
+		close(journalfile);
+		journalfile = -1;
+		return -1;
+	}
+	return 0;
+}
+void journalstop() {
+	if (journalfile == -1)
+		return;
+	pthread_mutex_lock(&journalmutex);
+	journalquit = 1;
+	pthread_cond_signal(&journalwork);
+	pthread_mutex_unlock(&journalmutex);
+	pthread_join(journalthread, NULL);
+	close(journalfile);
+	free(journalfill);
+	free(journalwrite);
+	free(journalattrs);
+}
+
+/*
+ * write the journal up to the rows scrolled out so far
+ */
+void journalsync() {
+	int request;
+
+	recordsync();
+	pthread_mutex_lock(&journalmutex);
+	request = ++journalrequest;
+	pthread_cond_signal(&journalwork);
+	while (journalserved - request < 0)
+		pthread_cond_wait(&journaldone, &journalmutex);
+	pthread_mutex_unlock(&journalmutex);
+}
+
+/*
+ * control thread: copy the geometry of the buffer and keep its arrays from
+ * being freed until controlunpin(); the rows followed are numbered again if
+ * the screen was resized
+ */
+int controlpin(struct geometry *g) {
+	struct controlclient *c;
+	int seen;
+
+	seen = g->renumbered;
+	pthread_mutex_lock(&controlmutex);
+	g->number = geometry;
+	g->buffer = buffer;
+	g->buffersize = buffersize;
+	g->wrapped = wrapped;
+	g->wrappedrows = wrappedrows;
+	g->rows = winsize.ws_row;
+	g->cols = winsize.ws_col;
+	g->renumbered = renumbered;
+	g->top = renumberedtop;
+	g->base = rowbase;
+	controlbuffer = buffer;
+	pthread_mutex_unlock(&controlmutex);
+
+	if (g->renumbered != seen)
+		for (c = controlclient; c < controlclient + CONTROLCLIENTS; c++)
+			if (c->fd != -1 && c->follow != -1)
+				c->follow = g->top + g->base;
+	if (g->cols != controlcols) {
+		free(controldata);
+		free(controlcells);
+		controldata = malloc(CONTROLCHECK * (g->cols * 4 + 1));
+		controlcells = malloc(g->cols * sizeof(u_int32_t));
+		controlcols = g->cols;
+		if (controldata == NULL || controlcells == NULL) {
+			controlcols = 0;
+			return -1;
+		}
+	}
+	return 0;
+}
+void controlunpin() {
+	pthread_mutex_lock(&controlmutex);
+	controlbuffer = NULL;
+	free(orphanbuffer);
+	free(orphanwrapped);
+	orphanbuffer = NULL;
+	orphanwrapped = NULL;
+	pthread_mutex_unlock(&controlmutex);
+}
+
+/*
+ * main thread: free the buffer and wrapped of an old geometry, unless the
+ * control thread still reads them
+ */
+void controlrelease(u_int32_t *oldbuffer, char *oldwrapped) {
+	pthread_mutex_lock(&controlmutex);
+	if (oldbuffer != NULL && oldbuffer == controlbuffer) {
+		orphanbuffer = oldbuffer;
+		orphanwrapped = oldwrapped;
+		oldbuffer = NULL;
+		oldwrapped = NULL;
+	}
+	pthread_mutex_unlock(&controlmutex);
+	free(oldbuffer);
+	free(oldwrapped);
+}
+
+/*
+ * first row of the buffer not yet overwritten, given the rows retired
+ */
+int controllow(struct geometry *g, int retired) {
+	int low, reflowed;
+
+	low = retired + g->rows - g->buffersize / g->cols;
+	reflowed = __atomic_load_n(&reflowlow, __ATOMIC_ACQUIRE) / g->cols;
+	if (low < reflowed)
+		low = reflowed;
+	return low < 0 ? 0 : low;
+}
+
+/*
+ * copy a row to controlcells, then encode it as a line like encoderow()
+ */
+void controlcopy(struct geometry *g, int r) {
+	int pos, i;
+
+	pos = (long long) r * g->cols % g->buffersize;
+	for (i = 0; i < g->cols; i++)
+		controlcells[i] = g->buffer[(pos + i) % g->buffersize];
+}
+ssize_t controlline(char *dest, int cols, int wrap) {
+	ssize_t len;
+	int i;
+
+	if (! wrap)
+		while (cols > 0 && controlcells[cols - 1] == ' ')
+			cols--;
+	if (singlechar)
+		for (len = 0, i = 0; i < cols; i++)
+			dest[len++] = controlcells[i];
+	else
+		len = ucs4toutf8block(dest, controlcells, cols);
+	if (! wrap)
+		dest[len++] = '\n';
+	return len;
+}
+
+/*
+ * encode the rows from *first to end as lines; if len is not zero, only the
+ * rows containing the string, each preceded by its number; rows overwritten
+ * meanwhile are dropped and *first is moved after them; -1 if the geometry
+ * changed meanwhile
+ */
+ssize_t controlrows(struct geometry *g, char *dest, int *first, int end,
+		u_int32_t *string, int len) {
+	ssize_t used;
+	int r, low;
+
+	used = 0;
+	for (r = *first; r < end; r++) {
+		controlcopy(g, r);
+		if (len == 0)
+			used += controlline(dest + used, g->cols,
+				g->wrapped[r % g->wrappedrows]);
+		else if (len <= g->cols &&
+		         findlast(controlcells, g->cols, string, len) != -1) {
+			used += sprintf(dest + used, "%d\t", r + g->base);
+			used += controlline(dest + used, g->cols, 0);
+		}
+		if ((r + 1 - *first) % CONTROLCHECK != 0 && r + 1 != end)
+			continue;
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&geometry, __ATOMIC_SEQ_CST) != g->number)
+			return -1;
+		low = controllow(g, __atomic_load_n(&retiredrows,
+			__ATOMIC_SEQ_CST) - g->base);
+		if (low > *first) {
+			used = 0;
+			*first = low;
+			r = low - 1;
+		}
+	}
+	return used;
+}
+
+/*
+ * send to a client what its socket takes without waiting; -1 on error
+ */
+int controlflush(struct controlclient *c) {
+	ssize_t res;
+
+	while (c->unsentlen > 0) {
+		res = send(c->fd, c->unsent, c->unsentlen, MSG_NOSIGNAL);
+		if (res == -1 && errno == EINTR)
+			continue;
+		if (res == -1 && errno == EAGAIN)
+			return 0;
+		if (res == -1)
+			return -1;
+		c->unsent += res;
+		c->unsentlen -= res;
+	}
+	free(c->out);
+	c->out = NULL;
+	return 0;
+}
+
+/*
+ * send data to a client; what its socket does not take now is sent when it
+ * becomes writable, from out if data is in it, which is then freed, or from
+ * a copy if out is NULL; -1 on error
+ */
+int controlqueue(struct controlclient *c, char *out, char *data, size_t len) {
+	struct epoll_event ev;
+
+	c->out = out;
+	c->unsent = data;
+	c->unsentlen = len;
+	if (controlflush(c) == -1) {
+		c->unsentlen = 0;
+		return -1;
+	}
+	if (c->unsentlen == 0)
+		return 0;
+	if (out == NULL) {
+		c->out = malloc(c->unsentlen);
+		if (c->out == NULL) {
+			c->unsentlen = 0;
+			return -1;
+		}
+		memcpy(c->out, c->unsent, c->unsentlen);
+		c->unsent = c->out;
+	}
+	ev.events = EPOLLOUT;
+	ev.data.u32 = c - controlclient;
+	epoll_ctl(controlepoll, EPOLL_CTL_MOD, c->fd, &ev);
+	return 0;
+}
+int controlsend(struct controlclient *c, char *data, size_t len) {
+	return controlqueue(c, NULL, data, len);
+}
+
+/*
+ * send a sealed memfd with the header
+ */
+int controlsendfd(struct controlclient *c, char *header, int memfd) {
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE(sizeof(int))];
+
+	memset(&msg, 0, sizeof(msg));
+	iov.iov_base = header;
+	iov.iov_len = strlen(header);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+	return sendmsg(c->fd, &msg, MSG_NOSIGNAL) == -1 ? -1 : 0;
+}
+
+/*
+ * answer a request for rows: a header with the first and last row and the
+ * length of the lines, then the lines; with usefd, the lines are written to
+ * a memfd, which is sealed and passed with the header; the rows are encoded
+ * with the control thread unpinned from the geometry; -1 if it changed
+ * before, and nothing is sent; the lines are encoded after room for the
+ * header, so that both are sent from the same allocation
+ */
+int controlreply(struct geometry *g, struct controlclient *c, int first,
+		int end, u_int32_t *string, int len, int usefd) {
+	size_t size;
+	ssize_t used;
+	char *data, header[100];
+	int memfd, hlen;
+
+	size = (size_t) (end - first) * (g->cols * 4 + 13) + 1;
+	if (! usefd) {
+		data = malloc(sizeof(header) + size);
+		if (data == NULL) {
+			controlunpin();
+			controlsend(c, "error\n", 6);
+			return 0;
+		}
+		used = controlrows(g, data + sizeof(header), &first, end,
+			string, len);
+		controlunpin();
+		if (used == -1) {
+			free(data);
+			return -1;
+		}
+		hlen = sprintf(header, "%d %d %zd\n", first + g->base,
+			end + g->base, used);
+		memcpy(data + sizeof(header) - hlen, header, hlen);
+		controlqueue(c, data, data + sizeof(header) - hlen,
+			hlen + used);
+		return 0;
+	}
+
+	memfd = memfd_create("scrollback", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	data = memfd == -1 || ftruncate(memfd, size) == -1 ? MAP_FAILED :
+		mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	if (data == MAP_FAILED) {
+		controlunpin();
+		controlsend(c, "error\n", 6);
+		if (memfd != -1)
+			close(memfd);
+		return 0;
+	}
+	used = controlrows(g, data, &first, end, string, len);
+	controlunpin();
+	munmap(data, size);
+	if (used == -1) {
+		close(memfd);
+		return -1;
+	}
+	sprintf(header, "%d %d %zd\n", first + g->base, end + g->base,
+		used);
+	if (ftruncate(memfd, used) == -1 ||
+	    fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+	                              F_SEAL_WRITE | F_SEAL_SEAL) == -1)
+		controlsend(c, "error\n", 6);
+	else
+		controlsendfd(c, header, memfd);
+	close(memfd);
+	return 0;
+}
+
+/*
+ * close a client
+ */
+void controlclose(struct controlclient *c) {
+	if (c->follow != -1)
+		__atomic_store_n(&controlfollowers, controlfollowers - 1,
+			__ATOMIC_RELAXED);
+	close(c->fd);
+	c->fd = -1;
+	free(c->out);
+	c->out = NULL;
+	c->unsentlen = 0;
+}
+
+/*
+ * execute a request; return whether the client is to be kept open; rows are
+ * numbered and encoded again if the geometry changes meanwhile
+ */
+int controlrequest(struct controlclient *c, struct geometry *g) {
+	char *line;
+	int usefd, retired, low, first, n, len;
+	u_int32_t string[SEARCHLEN];
+	char answer[20];
+
+	line = c->line;
+	usefd = ! strncmp(line, "fd ", 3);
+	if (usefd)
+		line += 3;
+	for (;;) {
+		if (controlpin(g) == -1) {
+			controlunpin();
+			controlsend(c, "error\n", 6);
+			return 0;
+		}
+		retired = __atomic_load_n(&retiredrows, __ATOMIC_SEQ_CST) -
+			g->base;
+		low = controllow(g, retired);
+		len = 0;
+		if (sscanf(line, "last %d", &n) == 1 && n >= 0)
+			first = retired - n;
+		else if (sscanf(line, "since %d", &n) == 1)
+			first = n - g->base;
+		else if (! strncmp(line, "search ", 7) && line[7] != '\0') {
+			len = utf8tocells(string, SEARCHLEN,
+				line + 7, strlen(line + 7));
+			first = low;
+		}
+		else
+			break;
+		if (first < low)
+			first = low;
+		if (first > retired)
+			first = retired;
+		if (controlreply(g, c, first, retired,
+		                 string, len, usefd) == 0)
+			return 0;
+	}
+	controlunpin();
+
+	if (! strcmp(line, "follow")) {
+		c->follow = retired + g->base;
+		__atomic_store_n(&controlfollowers, controlfollowers + 1,
+			__ATOMIC_RELAXED);
+		return 1;
+	}
+	else if (! strcmp(line, "buffer") ||
+	         sscanf(line, "buffer %d", &n) == 1) {
+		if (! strcmp(line, "buffer"))
+			n = g->buffersize;
+		else if (n < g->rows * g->cols || n > INT_MAX / 8) {
+			controlsend(c, "error\n", 6);
+			return 0;
+		}
+		else {
+			__atomic_store_n(&bufferrequest, n, __ATOMIC_SEQ_CST);
+			eventfd_write(bufferevent, 1);
+		}
+		len = sprintf(answer, "%d\n", n);
+		controlsend(c, answer, len);
+		return 0;
+	}
+	controlsend(c, "error\n", 6);
+	return 0;
+}
+
+/*
+ * send the new rows to a client following them, a block at time; each
+ * block is encoded pinned to the geometry and sent unpinned; the next is
+ * encoded when the client took the previous, and with no memory for the
+ * rows the client stays, to be sent them on the next occasion
+ */
+int controlfollow(struct controlclient *c, struct geometry *g) {
+	int retired, end, first;
+	ssize_t len;
+
+	while (c->unsentlen == 0) {
+		if (controlpin(g) == -1) {
+			controlunpin();
+			return 0;
+		}
+		retired = __atomic_load_n(&retiredrows, __ATOMIC_SEQ_CST) -
+			g->base;
+		first = c->follow - g->base;
+		if (first < controllow(g, retired))
+			first = controllow(g, retired);
+		if (first >= retired) {
+			controlunpin();
+			break;
+		}
+		end = retired - first < CONTROLCHECK ?
+			retired : first + CONTROLCHECK;
+		len = controlrows(g, controldata, &first, end, NULL, 0);
+		controlunpin();
+		if (len == -1)
+			continue;
+		if (controlsend(c, controldata, len) == -1)
+			return -1;
+		c->follow = (first < end ? end : first) + g->base;
+	}
+	return 0;
+}
+
+/*
+ * control thread: accept clients and answer their requests; the main
+ * thread only waits for it to copy the geometry, not for the clients
+ */
+void *controlloop(void *arg) {
+	int n, i, fd;
+	struct epoll_event ev, events[CONTROLCLIENTS + 2];
+	struct controlclient *c;
+	struct geometry g;
+	eventfd_t value;
+	ssize_t len;
+
+	(void) arg;
+	memset(&g, 0, sizeof(g));
+	controlcols = 0;
+	controldata = NULL;
+	controlcells = NULL;
+	ev.events = EPOLLIN;
+	ev.data.u32 = CONTROLCLIENTS;
+	epoll_ctl(controlepoll, EPOLL_CTL_ADD, controlsocket, &ev);
+	ev.data.u32 = CONTROLCLIENTS + 1;
+	epoll_ctl(controlepoll, EPOLL_CTL_ADD, controlevent, &ev);
+
+	while (! __atomic_load_n(&controlquit, __ATOMIC_SEQ_CST)) {
+		n = epoll_wait(controlepoll, events, CONTROLCLIENTS + 2, -1);
+		for (i = 0; i < n; i++) {
+			if (events[i].data.u32 == CONTROLCLIENTS + 1) {
+				eventfd_read(controlevent, &value);
+				for (c = controlclient;
+				     c < controlclient + CONTROLCLIENTS; c++)
+					if (c->fd != -1 && c->follow != -1 &&
+					    controlfollow(c, &g) == -1)
+						controlclose(c);
+				continue;
+			}
+			if (events[i].data.u32 == CONTROLCLIENTS) {
+				fd = accept4(controlsocket, NULL, NULL,
+					SOCK_CLOEXEC | SOCK_NONBLOCK);
+				if (fd == -1)
+					continue;
+				for (c = controlclient; c->fd != -1; c++)
+					if (c == controlclient +
+					          CONTROLCLIENTS - 1) {
+						close(fd);
+						fd = -1;
+						break;
+					}
+				if (fd == -1)
+					continue;
+				c->fd = fd;
+				c->len = 0;
+				c->follow = -1;
+				c->out = NULL;
+				c->unsentlen = 0;
+				ev.events = EPOLLIN;
+				ev.data.u32 = c - controlclient;
+				epoll_ctl(controlepoll, EPOLL_CTL_ADD, fd, &ev);
+				continue;
+			}
+			c = &controlclient[events[i].data.u32];
+			if (c->fd == -1)
+				continue;
+			if (c->unsentlen > 0) {
+				if (controlflush(c) == -1 ||
+				    (c->unsentlen == 0 && c->follow == -1)) {
+					controlclose(c);
+					continue;
+				}
+				if (c->unsentlen > 0)
+					continue;
+				ev.events = EPOLLIN;
+				ev.data.u32 = c - controlclient;
+				epoll_ctl(controlepoll, EPOLL_CTL_MOD, c->fd, &ev);
+				if (controlfollow(c, &g) == -1)
+					controlclose(c);
+				continue;
+			}
+			len = read(c->fd, c->line + c->len,
+				CONTROLLINE - 1 - c->len);
+			if (len == -1 && errno == EAGAIN)
+				continue;
+			if (len <= 0 || c->follow != -1) {
+				controlclose(c);
+				continue;
+			}
+			c->len += len;
+			c->line[c->len] = '\0';
+			if (strchr(c->line, '\n') == NULL) {
+				if (c->len == CONTROLLINE - 1)
+					controlclose(c);
+				continue;
+			}
+			*strchr(c->line, '\n') = '\0';
+			if (c->len > 0 && c->line[strlen(c->line) - 1] == '\r')
+				c->line[strlen(c->line) - 1] = '\0';
+			if (! controlrequest(c, &g)) {
+				if (c->unsentlen == 0)
+					controlclose(c);
+			}
+			else if (controlfollow(c, &g) == -1)
+				controlclose(c);
+		}
+	}
+
+	for (c = controlclient; c < controlclient + CONTROLCLIENTS; c++)
+		if (c->fd != -1)
+			controlclose(c);
+	free(controldata);
+	free(controlcells);
+	return NULL;
+}
+
+/*
+ * start and stop the control thread
+ */
+int controlstart() {
+	struct sockaddr_un addr;
+	int i;
+
+	controlsocket = -1;
+	if (! control)
+		return 0;
+	snprintf(controlpath, sizeof(controlpath), CONTROLPATH,
+		getuid(), vtno);
+	if (strlen(controlpath) >= sizeof(addr.sun_path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, controlpath);
+	controlsocket = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (controlsocket == -1)
+		return -1;
+	unlink(controlpath);
+	if (bind(controlsocket, (struct sockaddr *) &addr, sizeof(addr)) ==
+	    -1 || chmod(controlpath, 0600) == -1 ||
+	    listen(controlsocket, CONTROLCLIENTS) == -1) {
+		close(controlsocket);
+		controlsocket = -1;
+		return -1;
+	}
+	controlevent = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	controlepoll = epoll_create1(EPOLL_CLOEXEC);
+	for (i = 0; i < CONTROLCLIENTS; i++)
+		controlclient[i].fd = -1;
+	controlquit = 0;
+	controlfollowers = 0;
+	if (controlevent == -1 || controlepoll == -1 ||
+	    pthread_create(&controlthread, NULL, controlloop, NULL)) {
+		if (controlevent != -1)
+			close(controlevent);
+		if (controlepoll != -1)
+			close(controlepoll);
+		close(controlsocket);
+		controlsocket = -1;
+		unlink(controlpath);
+		return -1;
+	}
+	return 0;
+}
+void controlstop() {
+	if (controlsocket == -1)
+		return;
+	__atomic_store_n(&controlquit, 1, __ATOMIC_SEQ_CST);
+	eventfd_write(controlevent, 1);
+	pthread_join(controlthread, NULL);
+	close(controlepoll);
+	close(controlevent);
+	close(controlsocket);
+	unlink(controlpath);
+}
+
+/*
+ * marks of the shell: where prompts, commands and their output start
+ */
+#define MARKS 4096
+struct mark {
+	int pos;		/* cell, counted from the start */
+	short status;		/* exit status, for the end of a command */
+	char type;		/* A=prompt B=command C=output D=end */
+} marks[MARKS];
+int markfirst, marklast;	/* the marks, in a ring */
+
+/*
+ * add a mark; the ones past it were on a part of the screen rewritten since
+ */
+void markadd(int pos, char type, int status) {
+	struct mark *m;
+
+	while (marklast > markfirst && marks[(marklast - 1) % MARKS].pos > pos)
+		marklast--;
+	if (marklast - markfirst == MARKS)
+		markfirst++;
+	m = &marks[marklast++ % MARKS];
+	m->pos = pos;
+	m->type = type;
+	m->status = status;
+}
+
+/*
+ * first mark at pos or later
+ */
+int markafter(int pos) {
+	int low, high, mid;
+
+	low = markfirst;
+	high = marklast;
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (marks[mid % MARKS].pos < pos)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+/*
+ * row of the last prompt before pos, or of the first at pos or later;
+ * -1 if none
+ */
+int markprompt(int pos, int next) {
+	int i;
+
+	i = markafter(pos);
+	if (next)
+		while (i < marklast && marks[i % MARKS].type != 'A')
+			i++;
+	else
+		do
+			i--;
+		while (i >= markfirst && marks[i % MARKS].type != 'A');
+	if (i < markfirst || i >= marklast)
+		return -1;
+	pos = marks[i % MARKS].pos;
+	return pos - pos % winsize.ws_col;
+}
+
+/*
+ * the cells to save: all rows in the buffer, up to the cursor
+ */
+void saverange(int *start, int *cells) {
+	*start = bufferlow();
+	*cells = origin + (row + 1) * winsize.ws_col - *start;
+}
+
+/*
+ * save rows of the scrollback buffer to a file in LOGDIR, in background
+ */
+void savebackground(char *name, int start, int cells) {
+	char path[4096];
+	int savefile;
+	pid_t pid;
+	int res;
+
+	if (savepid != 0) {
+		notify("still saving");
+		return;
+	}
+
+	recordsync();
+	snprintf(path, 4096, LOGDIR "/%s", getuid(), name);
+	savefile = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (savefile == -1) {
+		notify("cannot create file\n");
+		return;
+	}
+
+					/* the child has a copy of the buffer */
+
+	timezoneupdate();
+	savestart = microseconds();
+	if (saveprepare(start, cells) == -1) {
+		close(savefile);
+		notify("cannot save");
+		return;
+	}
+	pid = fork();
+	if (pid == 0) {
+		res = savecells(savefile);
+		_exit(res == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+	close(savefile);
+	munmap(savejob.shared, savejob.sharedsize);
+	if (pid == -1) {
+		notify("cannot save");
+		return;
+	}
+	stats.savefork = microseconds() - savestart;
+	stats.saveprocesses = savejob.chunks;
+	savepid = pid;
+	notify("saving");
+}
+
+/*
+ * save the scrollback buffer
+ */
+void savebuffer() {
+	int start, cells;
+
+	if (debug & DEBUGESCAPE) {
+		fprintf(logescape, "[savebuffer]");
+		fflush(logescape);
+	}
+
+	if (journalfile != -1) {
+		journalsync();
+		notify("journal written");
+		return;
+	}
+
+	saverange(&start, &cells);
+	savebackground("scrollbackbuffer", start, cells);
+}
+
+/*
+ * save the output of the last command: from its mark to the next, or to the
+ * cursor if it is still running
+ */
+void savecommand() {
+	int low, cells, i, start, end;
+
+	saverange(&low, &cells);
+	for (i = marklast - 1; i >= markfirst; i--)
+		if (marks[i % MARKS].type == 'C')
+			break;
+	if (i < markfirst || marks[i % MARKS].pos < low) {
+		notify("no command output");
+		return;
+	}
+	start = marks[i % MARKS].pos;
+	end = i + 1 < marklast ? marks[(i + 1) % MARKS].pos :
+		origin + row * winsize.ws_col + col;
+	start -= start % winsize.ws_col;
+	end = (end + winsize.ws_col - 1) / winsize.ws_col * winsize.ws_col;
+	if (end > low + cells)
+		end = low + cells;
+	savebackground("scrollbackcommand", start, end - start);
+}
+
+/*
+ * store a number in a variable number of bytes, seven bits each
+ */
+int varint(unsigned char *dest, u_int32_t n) {
+	int len;
+
+	for (len = 0; n >= 0x80; n >>= 7)
+		dest[len++] = (n & 0x7F) | 0x80;
+	dest[len++] = n;
+	return len;
+}
+u_int32_t snapshotnumber(long long *pos) {
+	u_int32_t n;
+	unsigned char b;
+	int shift;
+
+	n = 0;
+	shift = 0;
+	do {
+		b = snapshotdata[(*pos)++ % SNAPSHOTDATA];
+		n |= (u_int32_t) (b & 0x7F) << shift;
+		shift += 7;
+	} while (b & 0x80);
+	return n;
+}
+
+/*
+ * take a snapshot of the screen, if changed since the last; the changes
+ * stored are the runs of different cells, each as the number of equal cells
+ * before, the number of different cells and the cells of the last snapshot
+ */
+void snapshot() {
+	int size, i, j, last, len;
+	u_int32_t *screen;
+
+	recordsync();
+	timezoneupdate();
+	nextsnapshot = microseconds() + SNAPSHOTINTERVAL * 1000000LL;
+	size = winsize.ws_row * winsize.ws_col;
+	screen = snapshotscreen;
+	len = 0;
+	last = 0;
+	for (i = 0; i < size; i = j) {
+		if (buffer[(origin + i) % buffersize] == screen[i]) {
+			j = i + 1;
+			continue;
+		}
+		for (j = i + 1; j < size; j++)
+			if (buffer[(origin + j) % buffersize] == screen[j])
+				break;
+		len += varint(snapshotchanges + len, i - last);
+		len += varint(snapshotchanges + len, j - i);
+		for (; i < j; i++) {
+			len += varint(snapshotchanges + len, screen[i]);
+			screen[i] = buffer[(origin + i) % buffersize];
+		}
+		last = j;
+	}
+	if (len > 0) {
+		while (snapshotlast > snapshotfirst &&
+		       (snapshotlast - snapshotfirst == SNAPSHOTS ||
+		        snapshotend + len - snapshots[snapshotfirst %
+				SNAPSHOTS].start > SNAPSHOTDATA))
+			snapshotfirst++;
+		snapshots[snapshotlast % SNAPSHOTS].start = snapshotend;
+		snapshots[snapshotlast % SNAPSHOTS].len = len;
+		snapshots[snapshotlast % SNAPSHOTS].date = snapshotdate;
+		snapshotlast++;
+		for (i = 0; i < len; i++)
+			snapshotdata[snapshotend++ % SNAPSHOTDATA] =
+				snapshotchanges[i];
+		if (snapshotshown > 0)
+			snapshotshown++;
+		if (snapshotshown > snapshotlast - snapshotfirst)
+			snapshotshown = snapshotlast - snapshotfirst;
+	}
+	snapshotdate = milliseconds();
+}
+
+/*
+ * turn the screen of a snapshot into the one before
+ */
+void snapshotback(u_int32_t *screen, int n) {
+	long long pos, end;
+	int i, count;
+
+	pos = snapshots[n % SNAPSHOTS].start;
+	end = pos + snapshots[n % SNAPSHOTS].len;
+	for (i = 0; pos < end; ) {
+		i += snapshotnumber(&pos);
+		count = snapshotnumber(&pos);
+		for (; count > 0; count--)
+			screen[i++] = snapshotnumber(&pos);
+	}
+}
+
+/*
+ * show the screen some snapshots back
+ */
+void showsnapshot() {
+	int size, n;
+	char date[TIMELEN];
+
+	size = winsize.ws_row * winsize.ws_col;
+	memcpy(snapshotview, snapshotscreen, size * sizeof(u_int32_t));
+	for (n = 1; n <= snapshotshown; n++)
+		snapshotback(snapshotview, snapshotlast - n);
+	timezoneupdate();
+	timeformat(date, snapshots[(snapshotlast - snapshotshown) %
+		SNAPSHOTS].date);
+	outputstring(MAKECURSORINVISIBLE HOMEPOSITION RESETATTRIBUTES);
+	outputformat("       " BLUEBACKGROUND "screen %d of %d" NORMALBACKGROUND
+		"   seen at %s" ERASECURSORLINE "\r\n",
+		snapshotlast - snapshotfirst - snapshotshown + 1,
+		snapshotlast - snapshotfirst + 1, date);
+	printcells(snapshotview + snapshottop * winsize.ws_col,
+		size - 2 * winsize.ws_col);
+	outputstring("       " ERASECURSORLINE);
+	notify(snapshottop == 0 ?
+		"F8=older F12=newer F10=bottom" : "F8=older F12=newer F9=top");
+	outputflush();
+}
+
+/*
+ * move to an older screen, or to a newer one
+ */
+void snapshotstep(int older) {
+	if (older && snapshotshown == 0) {
+		snapshot();
+		snapshottop = 0;
+	}
+	if (older && snapshotshown >= snapshotlast - snapshotfirst) {
+		notify("no older screen");
+		return;
+	}
+	snapshotshown += older ? 1 : -1;
+	if (snapshotshown > 0)
+		showsnapshot();
+	else
+		showscrollback();
+}
+
+/*
+ * reflow of the rows scrolled out to the width of the screen, in a thread;
+ * the lines are read from the old buffer and written to the new one from the
+ * last to the first, so that the most recent rows are in place first
+ */
+struct point {
+	int offset;		/* cell in the line */
+	unsigned short attr;	/* set from it on */
+};
+struct {
+	u_int32_t *buffer;	/* the old buffer and its rows */
+	int size;
+	int released;		/* its cells from here on are given back */
+	int move;		/* same width, same numbering: only copy */
+	char *wrapped;
+	int wrappedrows;
+	struct timeblock *timeblocks;
+	int timeslots;
+	struct indexblock *indexblocks;
+	int indexslots;
+	int timetop, indextop;	/* blocks from these on are moved already */
+	struct span *spans;
+	int spanslots, spanfirst, spanlast;
+	int cols;		/* old width */
+	int first, end;		/* old rows to reflow or to move */
+	int top;		/* new row after the reflowed ones */
+	struct mark *marks;	/* old marks in the rows, in order */
+	int markcount;
+	struct span *newspans;	/* spans of the new rows */
+	int newspancount, newspanslots;
+	struct mark *newmarks;	/* marks of the new rows */
+	int newmarkcount;
+	struct point *points;	/* changes of set along a line */
+	int pointcount, pointslots;
+	long long start;	/* microseconds */
+} reflowjob;
+
+/*
+ * copy cells from the old buffer to the new one, blank cells in the new one
+ */
+void reflowcopy(int from, int to, int n) {
+	int f, t, len;
+
+	for (; n > 0; n -= len, from += len, to += len) {
+		f = from % reflowjob.size;
+		t = to % buffersize;
+		len = n;
+		if (len > reflowjob.size - f)
+			len = reflowjob.size - f;
+		if (len > buffersize - t)
+			len = buffersize - t;
+		memcpy(buffer + t, reflowjob.buffer + f,
+			len * sizeof(u_int32_t));
+	}
+}
+void reflowblank(int to, int n) {
+	for (; n > 0; n--, to++)
+		buffer[to % buffersize] = ' ';
+}
+
+/*
+ * give the whole pages in some memory back to the kernel
+ */
+void reflowgive(void *data, size_t len) {
+	uintptr_t page, start, end;
+
+	page = sysconf(_SC_PAGESIZE);
+	start = ((uintptr_t) data + page - 1) & ~(page - 1);
+	end = ((uintptr_t) data + len) & ~(page - 1);
+	if (start < end)
+		madvise((void *) start, end - start, MADV_DONTNEED);
+}
+
+/*
+ * give the pages of the old buffer from a cell on back to the kernel, since
+ * they are not read any more; done every RELEASECELLS cells
+ */
+#define RELEASECELLS (256 * 1024)
+void reflowrelease(int from) {
+	int pos, f, n, len;
+
+	if (reflowjob.released - from < RELEASECELLS)
+		return;
+	for (pos = from, n = reflowjob.released - from; n > 0;
+	     n -= len, pos += len) {
+		f = pos % reflowjob.size;
+		len = n < reflowjob.size - f ? n : reflowjob.size - f;
+		reflowgive(reflowjob.buffer + f, len * sizeof(u_int32_t));
+	}
+	reflowjob.released = from;
+}
+
+/*
+ * the thread is done: the old buffer and tables are given back at once, so
+ * that freeing them does not stop the main thread
+ */
+void reflowdone() {
+	reflowgive(reflowjob.buffer, reflowjob.size * sizeof(u_int32_t));
+	reflowgive(reflowjob.wrapped, reflowjob.wrappedrows);
+	reflowgive(reflowjob.timeblocks,
+		reflowjob.timeslots * sizeof(struct timeblock));
+	reflowgive(reflowjob.indexblocks,
+		reflowjob.indexslots * sizeof(struct indexblock));
+	eventfd_write(reflowevent, 1);
+}
+
+/*
+ * date of an old row, -1 if not known
+ */
+long long reflowtime(int r) {
+	struct timeblock *t;
+
+	t = &reflowjob.timeblocks[r / TIMEBLOCK % reflowjob.timeslots];
+	if (t->block != r / TIMEBLOCK)
+		return -1;
+	return t->base + t->delta[r % TIMEBLOCK];
+}
+
+/*
+ * store the dates of the new rows of a block, -1 for the ones not known
+ */
+void reflowtimes(int block, long long *times) {
+	struct timeblock *t;
+	long long base;
+	int i;
+
+	base = -1;
+	for (i = 0; i < TIMEBLOCK; i++)
+		if (times[i] != -1 && (base == -1 || times[i] < base))
+			base = times[i];
+	if (base == -1)
+		return;
+	t = &timeblocks[block % timeslots];
+	t->base = base;
+	for (i = 0; i < TIMEBLOCK; i++)
+		t->delta[i] = times[i] == -1 ? 0 :
+			times[i] - base >= 0xFFFFFFFF ? 0xFFFFFFFF :
+			times[i] - base;
+	__atomic_store_n(&t->block, block, __ATOMIC_RELEASE);
+}
+
+/*
+ * append a change of set along the line, a span of a new row, a mark
+ */
+void reflowpoint(int offset, unsigned short attr) {
+	struct point *p;
+
+	if (reflowjob.pointcount > 0) {
+		p = &reflowjob.points[reflowjob.pointcount - 1];
+		if (p->offset == offset) {
+			p->attr = attr;
+			return;
+		}
+		if (p->attr == attr)
+			return;
+	}
+	else if (attr == 0)
+		return;
+	if (reflowjob.pointcount == reflowjob.pointslots) {
+		p = realloc(reflowjob.points,
+			2 * reflowjob.pointslots * sizeof(struct point));
+		if (p == NULL)
+			return;
+		reflowjob.points = p;
+		reflowjob.pointslots *= 2;
+	}
+	p = &reflowjob.points[reflowjob.pointcount++];
+	p->offset = offset;
+	p->attr = attr;
+}
+void reflowspan(int row, int col, unsigned short attr) {
+	struct span *s;
+
+	if (reflowjob.newspancount == reflowjob.newspanslots) {
+		s = realloc(reflowjob.newspans,
+			2 * reflowjob.newspanslots * sizeof(struct span));
+		if (s == NULL)
+			return;
+		reflowjob.newspans = s;
+		reflowjob.newspanslots *= 2;
+	}
+	s = &reflowjob.newspans[reflowjob.newspancount++];
+	s->row = row;
+	s->col = col;
+	s->attr = attr;
+}
+
+/*
+ * the spans of the line of the old rows from s to e, reflowed to n new rows
+ * from r; *i is the first old span after the line, and is moved to its first
+ */
+void reflowspans(int *i, int s, int e, int len, int r, int n) {
+	struct span *spans, *sp;
+	struct point *p;
+	int slots, j, k, x, q, start;
+	unsigned short a;
+
+	spans = reflowjob.spans;
+	slots = reflowjob.spanslots;
+	for (j = *i; j > reflowjob.spanfirst &&
+	             spans[(j - 1) % slots].row >= s; j--)
+		;
+	if (j == *i)
+		return;
+	reflowjob.pointcount = 0;
+	for (x = s, k = j; x <= e; x++) {
+		reflowpoint((x - s) * reflowjob.cols, 0);
+		for (; k < *i && (sp = &spans[k % slots])->row == x; k++)
+			reflowpoint((x - s) * reflowjob.cols + sp->col,
+				sp->attr);
+	}
+	reflowpoint(len, 0);
+	*i = j;
+
+	p = reflowjob.points;
+	a = 0;
+	for (q = 0, k = 0; q < n; q++) {
+		start = q * winsize.ws_col;
+		for (; k < reflowjob.pointcount && p[k].offset <= start; k++)
+			a = p[k].attr;
+		if (a != 0)
+			reflowspan(r + q, 0, a);
+		for (; k < reflowjob.pointcount &&
+		       p[k].offset < start + winsize.ws_col; k++)
+			if (p[k].attr != a) {
+				a = p[k].attr;
+				reflowspan(r + q, p[k].offset - start, a);
+			}
+	}
+}
+
+/*
+ * order of spans
+ */
+int reflowcompare(const void *a, const void *b) {
+	const struct span *x = a, *y = b;
+
+	if (x->row != y->row)
+		return x->row < y->row ? -1 : 1;
+	return x->col < y->col ? -1 : x->col > y->col ? 1 : 0;
+}
+
+/*
+ * reflow thread: move the lines to the new buffer, from the last; each line
+ * is the old rows continuing one on the next, without the trailing blanks
+ */
+void *reflowloop(void *arg) {
+	int cols, s, e, c, len, n, r, k, m, i, block;
+	long long times[TIMEBLOCK];
+	struct mark *old, *new, mark;
+
+	(void) arg;
+	cols = winsize.ws_col;
+	r = reflowjob.top;
+	m = reflowjob.markcount - 1;
+	i = reflowjob.spanlast;
+	block = -1;
+	for (e = reflowjob.end - 1; e >= reflowjob.first; e = s - 1) {
+		for (s = e; s > reflowjob.first &&
+		     reflowjob.wrapped[(s - 1) % reflowjob.wrappedrows]; s--)
+			;
+		for (c = reflowjob.cols; c > 0; c--)
+			if (reflowjob.buffer[((long long) e * reflowjob.cols +
+			                     c - 1) % reflowjob.size] != ' ')
+				break;
+		len = (e - s) * reflowjob.cols + c;
+		n = len == 0 ? 1 : (len + cols - 1) / cols;
+
+					/* the main thread may need the room */
+
+		__atomic_store_n(&reflowwriting, (r - n) * cols,
+			__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&reflowquit, __ATOMIC_SEQ_CST) ||
+		    (r - n) * cols <
+		    __atomic_load_n(&reflowlimit, __ATOMIC_SEQ_CST))
+			break;
+		r -= n;
+
+		reflowcopy(s * reflowjob.cols, r * cols, len);
+		reflowblank(r * cols + len, n * cols - len);
+		reflowrelease(s * reflowjob.cols);
+		for (k = n - 1; k >= 0; k--) {
+			wrapped[(r + k) % wrappedrows] = k < n - 1;
+			if ((r + k) / TIMEBLOCK != block) {
+				if (block != -1)
+					reflowtimes(block, times);
+				block = (r + k) / TIMEBLOCK;
+				for (c = 0; c < TIMEBLOCK; c++)
+					times[c] = -1;
+			}
+			times[(r + k) % TIMEBLOCK] =
+				reflowtime(s + k * cols / reflowjob.cols);
+		}
+		reflowspans(&i, s, e, len, r, n);
+		for (; m >= 0 && reflowjob.marks[m].pos >= s * reflowjob.cols;
+		     m--) {
+			old = &reflowjob.marks[m];
+			new = &reflowjob.newmarks[reflowjob.newmarkcount++];
+			*new = *old;
+			c = old->pos - s * reflowjob.cols;
+			new->pos = r * cols + (c < len ? c : len);
+		}
+
+		__atomic_store_n(&reflowlow, r * cols, __ATOMIC_RELEASE);
+	}
+	if (block != -1)
+		reflowtimes(block, times);
+
+					/* spans and marks in order */
+
+	qsort(reflowjob.newspans, reflowjob.newspancount, sizeof(struct span),
+		reflowcompare);
+	for (k = 0, e = reflowjob.newmarkcount - 1; k < e; k++, e--) {
+		mark = reflowjob.newmarks[k];
+		reflowjob.newmarks[k] = reflowjob.newmarks[e];
+		reflowjob.newmarks[e] = mark;
+	}
+	reflowdone();
+	return NULL;
+}
+
+/*
+ * move the dates and the index of a block of rows to the new tables
+ */
+void movetimes(int b) {
+	struct timeblock *t;
+
+	t = &reflowjob.timeblocks[b % reflowjob.timeslots];
+	if (t->block == b)
+		timeblocks[b % timeslots] = *t;
+	else
+		timeblocks[b % timeslots].block = -1;
+}
+void moveindex(int b) {
+	struct indexblock *x;
+
+	x = &reflowjob.indexblocks[b % reflowjob.indexslots];
+	if (x->block == b)
+		indexblocks[b % indexslots] = *x;
+	else
+		indexblocks[b % indexslots].block = -1;
+}
+
+/*
+ * move thread: copy the rows to the new buffer of the same width, from the
+ * last, MOVECELLS cells at time, with their flags, dates and index; the rows
+ * change place, not their number
+ */
+#define MOVECELLS (1024 * 1024)
+void *moveloop(void *arg) {
+	int cols, e, n, r, b;
+
+	(void) arg;
+	cols = winsize.ws_col;
+	n = MOVECELLS / cols > 0 ? MOVECELLS / cols : 1;
+	for (e = reflowjob.end; e > reflowjob.first; e -= n) {
+		if (n > e - reflowjob.first)
+			n = e - reflowjob.first;
+		__atomic_store_n(&reflowwriting, (e - n) * cols,
+			__ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&reflowquit, __ATOMIC_SEQ_CST) ||
+		    (e - n) * cols <
+		    __atomic_load_n(&reflowlimit, __ATOMIC_SEQ_CST))
+			break;
+		reflowcopy((e - n) * cols, (e - n) * cols, n * cols);
+		reflowrelease((e - n) * cols);
+		for (r = e - n; r < e; r++)
+			wrapped[r % wrappedrows] =
+				reflowjob.wrapped[r % reflowjob.wrappedrows];
+		for (b = (e - n) / TIMEBLOCK; b < reflowjob.timetop; b++)
+			movetimes(b);
+		if (reflowjob.timetop > (e - n) / TIMEBLOCK)
+			reflowjob.timetop = (e - n) / TIMEBLOCK;
+		for (b = (e - n) * cols / INDEXBLOCK; b < reflowjob.indextop;
+		     b++)
+			moveindex(b);
+		if (reflowjob.indextop > (e - n) * cols / INDEXBLOCK)
+			reflowjob.indextop = (e - n) * cols / INDEXBLOCK;
+		__atomic_store_n(&reflowlow, (e - n) * cols, __ATOMIC_RELEASE);
+	}
+	reflowdone();
+	return NULL;
+}
+
+/*
+ * free the old buffer and what the reflow used
+ */
+void reflowfree() {
+	controlrelease(reflowjob.buffer, reflowjob.wrapped);
+	free(reflowjob.timeblocks);
+	free(reflowjob.indexblocks);
+	free(reflowjob.spans);
+	free(reflowjob.marks);
+	free(reflowjob.newspans);
+	free(reflowjob.newmarks);
+	free(reflowjob.points);
+}
+
+/*
+ * wait for the reflow thread to finish, or stop it; then place the spans and
+ * the marks of the rows it reflowed before the ones made since; a move keeps
+ * them where they are
+ */
+void reflowend(int quit) {
+	struct span *s;
+	struct mark *m;
+	eventfd_t value;
+	int skip, n, i;
+
+	if (! reflowing)
+		return;
+	__atomic_store_n(&reflowquit, quit, __ATOMIC_SEQ_CST);
+	pthread_join(reflowthread, NULL);
+	eventfd_read(reflowevent, &value);
+	reflowing = 0;
+	recordsync();
+	if (reflowjob.move) {
+		stats.movetime = microseconds() - reflowjob.start;
+		stats.moverows = reflowjob.end - reflowlow / winsize.ws_col;
+		reflowfree();
+		return;
+	}
+
+	skip = reflowjob.newspancount - (spanslots - (spanlast - spanfirst));
+	s = malloc(spanslots * sizeof(struct span));
+	if (s != NULL) {
+		n = 0;
+		for (i = skip > 0 ? skip : 0; i < reflowjob.newspancount; i++)
+			s[n++] = reflowjob.newspans[i];
+		for (i = spanfirst; i < spanlast; i++)
+			s[n++] = spans[i % spanslots];
+		free(spans);
+		spans = s;
+		spanfirst = 0;
+		spanlast = n;
+	}
+
+	skip = reflowjob.newmarkcount - (MARKS - (marklast - markfirst));
+	m = malloc(MARKS * sizeof(struct mark));
+	if (m != NULL) {
+		n = 0;
+		for (i = skip > 0 ? skip : 0; i < reflowjob.newmarkcount; i++)
+			m[n++] = reflowjob.newmarks[i];
+		for (i = markfirst; i < marklast; i++)
+			m[n++] = marks[i % MARKS];
+		memcpy(marks, m, n * sizeof(struct mark));
+		free(m);
+		markfirst = 0;
+		marklast = n;
+	}
+
+	stats.reflowtime = microseconds() - reflowjob.start;
+	stats.reflowrows = reflowjob.top - reflowlow / winsize.ws_col;
+	reflowfree();
+}
+
+/*
+ * the main thread is about to use the cells from reflowlimit on; stop the
+ * reflow thread if it writes there
+ */
+void reflowcheck() {
+	int limit;
+
+	limit = origin - (buffersize - winsize.ws_row * winsize.ws_col) /
+		winsize.ws_col * winsize.ws_col;
+	__atomic_store_n(&reflowlimit, limit, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&reflowwriting, __ATOMIC_SEQ_CST) < limit)
+		reflowend(1);
+}
+
+/*
+ * the rows scrolled out are being moved to a new buffer
+ */
+int moving() {
+	return reflowing && reflowjob.move;
+}
+
+/*
+ * the terminal changed size: the rows of the screen are cut or extended to
+ * the new width like the linux console does, after scrolling out the ones
+ * needed to keep the cursor on it; the rows scrolled out are reflowed in
+ * background into a new buffer, where the new rows start at a block of dates
+ */
+void resize(int master) {
+	struct winsize size;
+	int scrolled, drop, kept, cap, top, width, oldcols, oldrows;
+	int r, i, j, n, pos;
+	long long start, t, gap;
+	u_int32_t *newbuffer, *newscreen, *newview, *newshadow;
+	unsigned short *attrs, *newrowattrs, *newjournalattrs;
+	char *colored, *newwrapped;
+	unsigned char *newchanges;
+	struct timeblock *newtimeblocks;
+	struct mark *m, *jobmarks, *jobnewmarks;
+	struct span *newspans, *jobnewspans;
+	struct point *jobpoints;
+
+	resized = 0;
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == -1 ||
+	    (size.ws_row == winsize.ws_row && size.ws_col == winsize.ws_col))
+		return;
+	if (size.ws_row < 3 || size.ws_col == 0 ||
+	    size.ws_row * size.ws_col > buffersize)
+		return;
+	start = microseconds();
+	reflowend(1);
+	n = size.ws_row * size.ws_col;
+	newbuffer = malloc(buffersize * sizeof(u_int32_t));
+	newwrapped = calloc(buffersize / size.ws_col + 1, 1);
+	newtimeblocks = malloc(((buffersize / size.ws_col + 1) / TIMEBLOCK + 2) *
+		sizeof(struct timeblock));
+	jobmarks = malloc((marklast - markfirst + 1) * sizeof(struct mark));
+	jobnewmarks = malloc((marklast - markfirst + 1) * sizeof(struct mark));
+	jobnewspans = malloc(1024 * sizeof(struct span));
+	jobpoints = malloc(256 * sizeof(struct point));
+	attrs = calloc(n, sizeof(unsigned short));
+	colored = calloc(size.ws_row, 1);
+	newspans = malloc(spanslots * sizeof(struct span));
+	newrowattrs = malloc(size.ws_col * sizeof(unsigned short));
+	newjournalattrs = journalattrs == NULL ? NULL :
+		malloc(size.ws_col * sizeof(unsigned short));
+	newscreen = malloc(n * sizeof(u_int32_t));
+	newview = malloc(n * sizeof(u_int32_t));
+	newchanges = malloc(8 * n + 16);
+	newshadow = malloc(n * sizeof(u_int32_t));
+	if (newbuffer == NULL || newwrapped == NULL || newtimeblocks == NULL ||
+	    jobmarks == NULL || jobnewmarks == NULL || jobnewspans == NULL ||
+	    jobpoints == NULL || attrs == NULL || colored == NULL ||
+	    newspans == NULL || newrowattrs == NULL ||
+	    (journalattrs != NULL && newjournalattrs == NULL) ||
+	    newscreen == NULL || newview == NULL || newchanges == NULL ||
+	    newshadow == NULL) {
+		free(newbuffer);
+		free(newwrapped);
+		free(newtimeblocks);
+		free(jobmarks);
+		free(jobnewmarks);
+		free(jobnewspans);
+		free(jobpoints);
+		free(attrs);
+		free(colored);
+		free(newspans);
+		free(newrowattrs);
+		free(newjournalattrs);
+		free(newscreen);
+		free(newview);
+		free(newchanges);
+		free(newshadow);
+		if (show != origin)
+			notify("no memory for the resize");
+		return;
+	}
+	scrolled = show != origin;
+	show = origin;
+	searching = 0;
+	searchhit = -1;
+	jumping = 0;
+	sizing = 0;
+	snapshotshown = 0;
+
+					/* scroll out rows over the cursor */
+
+	oldrows = winsize.ws_row;
+	oldcols = winsize.ws_col;
+	drop = 0;
+	if (row > size.ws_row)
+		drop = oldrows - row < size.ws_row ?
+			oldrows - size.ws_row : row - size.ws_row / 2;
+	for (i = 0; i < drop; i++) {
+		colorscroll();
+		record((origin % buffersize) | RECORD_SCROLL,
+			origin / oldcols |
+			(wrapped[(origin / oldcols) % wrappedrows] ?
+				RECORD_WRAPPED : 0));
+		origin += oldcols;
+	}
+	recordsync();
+	kept = oldrows - drop < size.ws_row ? oldrows - drop : size.ws_row;
+	width = oldcols < size.ws_col ? oldcols : size.ws_col;
+
+					/* what the reflow reads */
+
+	memset(&reflowjob, 0, sizeof(reflowjob));
+	reflowjob.buffer = buffer;
+	reflowjob.size = buffersize;
+	reflowjob.move = 0;
+	reflowjob.wrapped = wrapped;
+	reflowjob.wrappedrows = wrappedrows;
+	reflowjob.timeblocks = timeblocks;
+	reflowjob.timeslots = timeslots;
+	reflowjob.spans = spans;
+	reflowjob.spanslots = spanslots;
+	reflowjob.spanfirst = spanfirst;
+	reflowjob.spanlast = spanlast;
+	reflowjob.cols = oldcols;
+	reflowjob.first = bufferlow() / oldcols;
+	reflowjob.end = origin / oldcols;
+	reflowjob.released = origin;
+	i = markafter(reflowjob.first * oldcols);
+	j = markafter(origin);
+	n = marklast - i;
+	reflowjob.marks = jobmarks;
+	for (r = 0; r < n; r++)
+		reflowjob.marks[r] = marks[(i + r) % MARKS];
+	reflowjob.markcount = j - i;
+	reflowjob.newmarks = jobnewmarks;
+	reflowjob.newmarkcount = 0;
+	reflowjob.newspanslots = 1024;
+	reflowjob.newspans = jobnewspans;
+	reflowjob.newspancount = 0;
+	reflowjob.pointslots = 256;
+	reflowjob.points = jobpoints;
+
+					/* the new geometry */
+
+	pthread_mutex_lock(&controlmutex);
+	winsize = size;
+	cap = buffersize / winsize.ws_col - winsize.ws_row;
+	top = (cap + TIMEBLOCK - 1) / TIMEBLOCK * TIMEBLOCK;
+	buffer = newbuffer;
+	wrappedrows = buffersize / winsize.ws_col + 1;
+	wrapped = newwrapped;
+	timeslots = wrappedrows / TIMEBLOCK + 2;
+	timeblocks = newtimeblocks;
+	for (i = 0; i < timeslots; i++)
+		timeblocks[i].block = -1;
+	origin = top * winsize.ws_col;
+	show = origin;
+
+					/* the screen */
+
+	for (r = 0; r < winsize.ws_row; r++) {
+		pos = origin + r * winsize.ws_col;
+		t = -1;
+		if (r < kept) {
+			reflowcopy((reflowjob.end + r) * oldcols, pos, width);
+			reflowblank(pos + width, winsize.ws_col - width);
+			wrapped[(top + r) % wrappedrows] =
+				oldcols == winsize.ws_col &&
+				reflowjob.wrapped[(reflowjob.end + r) %
+					reflowjob.wrappedrows];
+			t = reflowtime(reflowjob.end + r);
+		}
+		else
+			reflowblank(pos, winsize.ws_col);
+		timestamprow(top + r, t == -1 ? milliseconds() : t);
+	}
+	if (row - drop < winsize.ws_row)
+		row -= drop;
+	else
+		row = winsize.ws_row - 1;
+	if (col >= winsize.ws_col)
+		col = winsize.ws_col - 1;
+	positionstatus = POSITION_UNKNOWN;
+	timedcell = -1;
+
+	for (i = 0; i < indexslots; i++)
+		indexblocks[i].block = -1;
+	__atomic_store_n(&indexed, origin, __ATOMIC_RELEASE);
+	indexlow = origin;
+
+	markfirst = 0;
+	marklast = 0;
+	for (m = reflowjob.marks + reflowjob.markcount;
+	     m < reflowjob.marks + n; m++) {
+		r = (m->pos - reflowjob.end * oldcols) / oldcols;
+		pos = (m->pos - reflowjob.end * oldcols) % oldcols;
+		if (pos >= winsize.ws_col)
+			pos = winsize.ws_col - 1;
+		if (r < kept)
+			markadd(origin + r * winsize.ws_col + pos,
+				m->type, m->status);
+	}
+
+					/* colors */
+
+	for (r = 0, coloredrows = 0; r < kept; r++) {
+		i = (screentop + r) % oldrows;
+		if (! rowcolored[i])
+			continue;
+		memcpy(attrs + r * winsize.ws_col, screenattr + i * oldcols,
+			width * sizeof(unsigned short));
+		colored[r] = 1;
+		coloredrows++;
+	}
+	free(screenattr);
+	free(rowcolored);
+	screenattr = attrs;
+	rowcolored = colored;
+	screentop = 0;
+	spans = newspans;
+	spanfirst = 0;
+	spanlast = 0;
+	spanrows = top;
+	free(rowattrs);
+	rowattrs = newrowattrs;
+	free(journalattrs);
+	journalattrs = newjournalattrs;
+
+					/* snapshots and flood */
+
+	n = winsize.ws_row * winsize.ws_col;
+	free(snapshotscreen);
+	free(snapshotview);
+	free(snapshotchanges);
+	snapshotscreen = newscreen;
+	snapshotview = newview;
+	snapshotchanges = newchanges;
+	for (i = 0; i < n; i++)
+		snapshotscreen[i] = buffer[(origin + i) % buffersize];
+	snapshotfirst = snapshotlast;
+	snapshotdate = milliseconds();
+	free(shadow);
+	shadow = newshadow;
+	for (i = 0; i < n; i++)
+		shadow[i] = NOCELL;
+	shadoworigin = origin;
+
+					/* the rows scrolled out */
+
+	__atomic_store_n(&reflowlow, origin, __ATOMIC_RELEASE);
+	reflowwriting = origin;
+	reflowlimit = (top - cap) * winsize.ws_col;
+	reflowquit = 0;
+	reflowjob.top = top;
+	gap = (long long) (reflowjob.end - reflowjob.first) *
+		((oldcols + winsize.ws_col - 1) / winsize.ws_col);
+	if (gap > cap)
+		gap = cap > 0 ? cap : 0;
+	__atomic_store_n(&rowbase, rowbase + reflowjob.end + gap - top,
+		__ATOMIC_RELAXED);
+	__atomic_store_n(&retiredrows, top + rowbase, __ATOMIC_SEQ_CST);
+	renumbered++;
+	renumberedtop = top;
+	__atomic_store_n(&geometry, geometry + 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&controlmutex);
+
+	ioctl(master, TIOCSWINSZ, &winsize);
+	reflowjob.start = microseconds();
+	if (reflowjob.first < reflowjob.end && cap > 0 &&
+	    pthread_create(&reflowthread, NULL, reflowloop, NULL) == 0)
+		reflowing = 1;
+	else
+		reflowfree();
+	stats.resizes++;
+	stats.resizetime = microseconds() - start;
+	if (scrolled)
+		showscrollback();
+}
+
+/*
+ * tell the size of the buffer
+ */
+void buffernotice() {
+	char message[60];
+
+	snprintf(message, sizeof(message), "buffer: %d rows, %.1f MB",
+		buffersize / winsize.ws_col,
+		buffersize * sizeof(u_int32_t) / (1024.0 * 1024.0));
+	notify(message);
+}
+
+/*
+ * change the number of cells of the buffer; the screen and the page shown
+ * move to the new buffer at once, the other rows in background from the last,
+ * with their dates and index; the new tables are not initialized but for the
+ * blocks moved, since the others are not read; the rows between the page and
+ * the screen are not shown until moved
+ */
+void bufferresize(int size) {
+	int scrolled, low, limit, r, i, n, wrappedslots, timeslotsnew;
+	int indexslotsnew, spanslotsnew;
+	long long start;
+	u_int32_t *newbuffer;
+	char *newwrapped;
+	struct timeblock *newtimeblocks;
+	struct indexblock *newindexblocks;
+	struct span *newspans;
+
+	if (size == buffersize)
+		return;
+	if (size < winsize.ws_row * winsize.ws_col) {
+		if (show != origin)
+			notify("buffer too small");
+		return;
+	}
+	start = microseconds();
+	reflowend(1);
+	recordsync();
+	wrappedslots = size / winsize.ws_col + 1;
+	timeslotsnew = wrappedslots / TIMEBLOCK + 2;
+	indexslotsnew = size / INDEXBLOCK + 3;
+	spanslotsnew = size / 8 + 256;
+	newbuffer = malloc(size * sizeof(u_int32_t));
+	newwrapped = calloc(wrappedslots, 1);
+	newtimeblocks = calloc(timeslotsnew, sizeof(struct timeblock));
+	newindexblocks = calloc(indexslotsnew, sizeof(struct indexblock));
+	newspans = malloc(spanslotsnew * sizeof(struct span));
+	if (newbuffer == NULL || newwrapped == NULL || newtimeblocks == NULL ||
+	    newindexblocks == NULL || newspans == NULL) {
+		free(newbuffer);
+		free(newwrapped);
+		free(newtimeblocks);
+		free(newindexblocks);
+		free(newspans);
+		if (show != origin)
+			notify("no memory for the buffer");
+		return;
+	}
+
+					/* the rows kept */
+
+	limit = origin - (size - winsize.ws_row * winsize.ws_col) /
+		winsize.ws_col * winsize.ws_col;
+	low = bufferlow();
+	if (low < limit)
+		low = limit;
+	scrolled = show != origin;
+	if (show < low)
+		show = origin;
+
+	pthread_mutex_lock(&controlmutex);
+	memset(&reflowjob, 0, sizeof(reflowjob));
+	reflowjob.buffer = buffer;
+	reflowjob.size = buffersize;
+	reflowjob.released = origin;
+	reflowjob.move = 1;
+	reflowjob.first = low / winsize.ws_col;
+	reflowjob.end = origin / winsize.ws_col;
+	reflowjob.wrapped = wrapped;
+	reflowjob.wrappedrows = wrappedrows;
+	reflowjob.timeblocks = timeblocks;
+	reflowjob.timeslots = timeslots;
+	reflowjob.indexblocks = indexblocks;
+	reflowjob.indexslots = indexslots;
+	reflowjob.timetop = reflowjob.end / TIMEBLOCK;
+	reflowjob.indextop = (origin > 2 ? origin - 2 : 0) / INDEXBLOCK;
+	buffer = newbuffer;
+	buffersize = size;
+	wrapped = newwrapped;
+	wrappedrows = wrappedslots;
+	timeblocks = newtimeblocks;
+	timeslots = timeslotsnew;
+	indexblocks = newindexblocks;
+	indexslots = indexslotsnew;
+
+					/* the screen and the page shown */
+
+	reflowcopy(origin, origin, winsize.ws_row * winsize.ws_col);
+	n = origin / winsize.ws_col + winsize.ws_row;
+	for (r = reflowjob.end; r < n; r++)
+		wrapped[r % wrappedrows] =
+			reflowjob.wrapped[r % reflowjob.wrappedrows];
+	for (i = reflowjob.timetop; i <= (n - 1) / TIMEBLOCK; i++)
+		movetimes(i);
+	for (i = reflowjob.indextop; i <= n * winsize.ws_col / INDEXBLOCK; i++)
+		moveindex(i);
+	if (show != origin) {
+		n = origin - show < winsize.ws_row * winsize.ws_col ?
+			(origin - show) / winsize.ws_col : winsize.ws_row;
+		reflowcopy(show, show, n * winsize.ws_col);
+		for (r = show / winsize.ws_col; r < show / winsize.ws_col + n;
+		     r++)
+			wrapped[r % wrappedrows] =
+				reflowjob.wrapped[r % reflowjob.wrappedrows];
+		for (i = show / winsize.ws_col / TIMEBLOCK;
+		     i <= (show / winsize.ws_col + n - 1) / TIMEBLOCK &&
+		     i < reflowjob.timetop; i++)
+			movetimes(i);
+	}
+
+	i = spanlast - spanfirst > spanslotsnew ?
+		spanlast - spanslotsnew : spanfirst;
+	for (n = 0; i < spanlast; i++)
+		newspans[n++] = spans[i % spanslots];
+	free(spans);
+	spans = newspans;
+	spanslots = spanslotsnew;
+	spanfirst = 0;
+	spanlast = n;
+
+					/* the rows scrolled out */
+
+	__atomic_store_n(&reflowlow, origin, __ATOMIC_RELEASE);
+	reflowwriting = origin;
+	reflowlimit = limit;
+	reflowquit = 0;
+	__atomic_store_n(&geometry, geometry + 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_unlock(&controlmutex);
+
+	reflowjob.start = microseconds();
+	if (reflowjob.first < reflowjob.end &&
+	    pthread_create(&reflowthread, NULL, moveloop, NULL) == 0)
+		reflowing = 1;
+	else
+		reflowfree();
+	stats.buffersizes++;
+	stats.buffertime = microseconds() - start;
+	if (scrolled)
+		showscrollback();
+	if (show != origin && ! reflowing)
+		buffernotice();
+}
+
+/*
+ * whether a row contains the string to search (forward declaration)
+ */
+int searchrow(int pos);
+
+/*
+ * write cells of the buffer to a pipe, in order and a block of rows at time;
+ * if matching, only the rows containing the string to search; called in a
+ * forked process, with the memory for encoding allocated before
+ */
+#define STREAMROWS 1024
+#define STREAMSIZE (STREAMROWS * (winsize.ws_col * 4 + 1 + TIMELEN + \
+	(colors ? (winsize.ws_col + 1) * SGRLEN : 0)))
+int streamcells(int fd, int start, int cells, int matching,
+		char *data, unsigned short *attrs) {
+	ssize_t len;
+	int row, n, i, pos;
+
+	row = start / winsize.ws_col;
+	start %= buffersize;
+	for (; cells > 0; cells -= n, row += STREAMROWS) {
+		n = cells < STREAMROWS * winsize.ws_col ?
+			cells : STREAMROWS * winsize.ws_col;
+		if (! matching)
+			len = encoderows(data, start, row, n, attrs);
+		else
+			for (len = 0, i = 0; i < n; i += winsize.ws_col) {
+				pos = (start + i) % buffersize;
+				if (! searchrow(pos))
+					continue;
+				if (timestamps)
+					len += timeprefix(data + len,
+						row + i / winsize.ws_col);
+				len += encodecolored(data + len, pos,
+					row + i / winsize.ws_col, 0, attrs);
+			}
+		if (writeall(fd, data, len) == -1)
+			return -1;
+		start = (start + n) % buffersize;
+	}
+	return 0;
+}
+
+/*
+ * show the scrollback buffer in less, streaming it through a pipe
+ */
+void pagebuffer(int matching) {
+	int start, cells;
+	int pipefd[2];
+	pid_t pid, pager;
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	char *argv[] = {"less", colors ? "-R" : NULL, NULL};
+	char *data;
+	unsigned short *attrs;
+	int res, status;
+
+	if (debug & DEBUGESCAPE) {
+		fprintf(logescape, "[pagebuffer]");
+		fflush(logescape);
+	}
+
+	recordsync();
+	data = malloc(STREAMSIZE);
+	attrs = malloc(winsize.ws_col * sizeof(unsigned short));
+	if (data == NULL || attrs == NULL || pipe2(pipefd, O_CLOEXEC) == -1) {
+		free(data);
+		free(attrs);
+		notify("cannot create pipe");
+		return;
+	}
+
+					/* the child has a copy of the buffer */
+
+	timezoneupdate();
+	saverange(&start, &cells);
+	pid = fork();
+	if (pid == 0) {
+		close(pipefd[0]);
+		res = streamcells(pipefd[1], start, cells, matching,
+			data, colors ? attrs : NULL);
+		_exit(res == -1 ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+	close(pipefd[1]);
+	free(data);
+	free(attrs);
+	if (pid == -1) {
+		close(pipefd[0]);
+		notify("cannot fork");
+		return;
+	}
+
+					/* run less on the pipe */
+
+	notify("less");
+	notify(MOVECURSORUP "\b\b ");
+	inputpause();
+	outputdrain();
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, pipefd[0], STDIN_FILENO);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &signalmask);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+	res = posix_spawnp(&pager, argv[0], &actions, &attr, argv, environ);
+	posix_spawn_file_actions_destroy(&actions);
+	posix_spawnattr_destroy(&attr);
+	close(pipefd[0]);
+	if (res == 0)
+		waitpid(pager, &status, 0);
+	waitpid(pid, NULL, 0);
+	inputresume();
+	if (res != 0) {
+		notify(strerror(res));
+		sleep(2);
+	}
+	showscrollback();
+}
+
+/*
+ * exchange one block of data between terminal and shell (forward declaration)
+ */
+int exchange(int master, int readshell);
+
+/*
+ * make the current position known
+ */
+void knowposition(int master, int alreadyasked) {
+
+	if (! alreadyasked && positionstatus == POSITION_KNOWN)
+		return;
+
+	if (debug & DEBUGESCAPE)
+		fprintf(logescape, "[knowposition(%d)]", alreadyasked);
+
+	if (synchronized)
+		endsynchronized(0);
+	if (! alreadyasked) {
+		outputstring(ASKPOSITION);
+		outputflush();
+	}
+
+	positionstatus = POSITION_UNKNOWN;
+	querytimeout = 0;
+	armtimer(querytimer, POSITIONTIMEOUT);
+	while (positionstatus == POSITION_UNKNOWN && ! querytimeout)
+		if (exchange(master, 0) == -1)
+			break;
+	armtimer(querytimer, 0);
+}
+
+/*
+ * obtain the current position from an escape sequence
+ */
+int readposition(char *sequence, char terminator) {
+	char s, t;
+	int x, y;
+
 	if (4 != sscanf(sequence, SEQUENCE2ARGS, &s, &y, &x, &t))
 		return 0;
 	if (s != SEQUENCESTARTER || t != terminator)
@@ -646,17 +5096,137 @@ int readposition(char *sequence, char terminator) {
 	return 1;
 }
 
+/*
+ * follow a cursor movement sequence
+ */
+int movecursor(char *sequence) {
+	int args[2], n, len, i;
+	char final;
+
+	len = strlen(sequence);
+	if (len < 3 || sequence[0] != SEQUENCESTARTER || sequence[1] != '[')
+		return 0;
+	final = sequence[len - 1];
+	if (! strchr("HfABCDGd", final))
+		return 0;
+
+	n = 0;
+	args[0] = 0;
+	args[1] = 0;
+	for (i = 2; i < len - 1; i++)
+		if (sequence[i] == ';' && n == 0)
+			n++;
+		else if (isdigit(sequence[i]) && args[n] < 10000)
+			args[n] = args[n] * 10 + sequence[i] - '0';
+		else
+			return 0;
+	for (i = 0; i < 2; i++)
+		if (args[i] == 0)
+			args[i] = 1;
+
+	if (final != 'H' && final != 'f') {
+		if (positionstatus != POSITION_KNOWN || n != 0)
+			return 0;
+		if (col >= winsize.ws_col)
+			col = winsize.ws_col - 1;
+	}
+	switch (final) {
+	case 'H':
+	case 'f':
+		row = args[0] - 1;
+		col = args[1] - 1;
+		break;
+	case 'A':
+		row -= args[0];
+		break;
+	case 'B':
+		row += args[0];
+		break;
+	case 'C':
+		col += args[0];
+		break;
+	case 'D':
+		col -= args[0];
+		break;
+	case 'G':
+		col = args[0] - 1;
+		break;
+	case 'd':
+		row = args[0] - 1;
+		break;
+	}
+	row = row < 0 ? 0 : row >= winsize.ws_row ? winsize.ws_row - 1 : row;
+	col = col < 0 ? 0 : col >= winsize.ws_col ? winsize.ws_col - 1 : col;
+	positionstatus = POSITION_KNOWN;
+	if (debug & DEBUGESCAPE)
+		fprintf(logescape, "[moveposition:%d,%d]", row, col);
+	return 1;
+}
+
+/*
+ * mark a row of the screen as continuing on the next or not
+ */
+void setwrapped(int r, int value) {
+	wrapped[(origin / winsize.ws_col + r) % wrappedrows] = value;
+}
+
 /*
  * erase part of the scrollback buffer
  */
 void erase(int startrow, int startcol, int endcol) {
-	int start, i;
+	int start, r;
+	if (coloredrows > 0) {
+		uncolor(startrow, startcol, endcol);
+		for (r = startrow + 1; r < winsize.ws_row; r++)
+			uncolor(r, 0, winsize.ws_col);
+	}
 	start = winsize.ws_col * startrow;
-	for (i = start + startcol; i < start + endcol; i++)
-		buffer[(origin + i) % buffersize] = ' ';
+	if (endcol > startcol)
+		recordclear(origin + start + startcol, endcol - startcol);
+	if (endcol >= winsize.ws_col)
+		setwrapped(startrow, 0);
 	start += winsize.ws_col;
-	for (i = start; i < winsize.ws_row * winsize.ws_col; i++)
-		buffer[(origin + i) % buffersize] = ' ';
+	if (start < winsize.ws_row * winsize.ws_col)
+		recordclear(origin + start,
+			winsize.ws_row * winsize.ws_col - start);
+	for (r = startrow + 1; r < winsize.ws_row; r++)
+		setwrapped(r, 0);
+}
+
+/*
+ * erase the scrollback buffer from the cursor to the end of its row
+ */
+void eraseline() {
+	if (coloredrows > 0 && col < winsize.ws_col)
+		uncolor(row, col, winsize.ws_col);
+	if (col < winsize.ws_col)
+		recordclear(origin + winsize.ws_col * row + col,
+			winsize.ws_col - col);
+	setwrapped(row, 0);
+}
+
+/*
+ * process a sequence that does not need to end a flood
+ */
+int floodsequence(char *sequence) {
+	int len;
+
+	len = strlen(sequence);
+	if (sequence[1] == '[' && sequence[len - 1] == 'm') {
+		if (strlen(floodattributes) + len >= sizeof(floodattributes))
+			floodattributes[0] = '\0';
+		strcat(floodattributes, sequence);
+		setattributes(sequence + 2);
+		return 1;
+	}
+	if (! strcmp(sequence, ERASECURSORLINE) && col < winsize.ws_col) {
+		eraseline();
+		return 1;
+	}
+	if (! strcmp(sequence, BEGINSYNCHRONIZED) ||
+	    ! strcmp(sequence, ENDSYNCHRONIZED))
+		return 1;
+	return movecursor(sequence);
 }
 
 /*
@@ -666,20 +5236,56 @@ void newrow() {
 	if (row < winsize.ws_row - 1)
 		row++;
 	else {
+		colorscroll();
+		record((origin % buffersize) | RECORD_SCROLL,
+			origin / winsize.ws_col |
+			(wrapped[(origin / winsize.ws_col) % wrappedrows] ?
+				RECORD_WRAPPED : 0));
 		origin += winsize.ws_col;
 		show = origin;
+		if (reflowing)
+			reflowcheck();
 		erase(winsize.ws_row - 1, 0, winsize.ws_col);
 	}
+	timestamprow(origin / winsize.ws_col + row, milliseconds());
 }
 
 /*
  * process a character from the shell
  */
-#define SEQUENCELEN 40
 char sequence[SEQUENCELEN];
 int escape = -1;
+int markheld;		/* start of the sequence held as start of a mark */
 unsigned char utf8[SEQUENCELEN];
 int utf8pos = 0, utf8len = 0;
+
+/*
+ * send the characters held as the possible start of a mark
+ */
+void markrelease() {
+	if (markheld == 0)
+		return;
+	sequence[markheld] = '\0';
+	if (! flood)
+		outputstring(sequence);
+	else
+		stats.dropped += markheld;
+	markheld = 0;
+}
+
+/*
+ * a mark from the shell: \033]133;A for example, terminated by BEL or ST
+ */
+void promptmark(int master, char *params) {
+	if (debug & DEBUGESCAPE)
+		fprintf(logescape, "[mark:%s]", params);
+	if (params[0] < 'A' || params[0] > 'D')
+		return;
+	knowposition(master, 0);
+	markadd(origin + row * winsize.ws_col + col, params[0],
+		params[0] == 'D' && params[1] == ';' ? atoi(params + 2) : 0);
+}
+
 void shelltoterminal(int master, unsigned char c) {
 	int pos;
 	u_int32_t w;
@@ -693,11 +5299,48 @@ void shelltoterminal(int master, unsigned char c) {
 		showscrollback(winsize);
 	}
 
+				/* shell marks, not sent to the terminal */
+
+	if (c <= 0x1F && c != ESCAPE && escape >= 0 &&
+	    markheld < (int) strlen(PROMPTMARK))
+		markrelease();
+	if (escape >= 0 && markheld == (int) strlen(PROMPTMARK)) {
+		if (c == BEL || (c == '\\' && sequence[escape - 1] == ESCAPE)) {
+			pos = escape;
+			escape = -1;
+			markheld = 0;
+			if (pos == SEQUENCELEN)
+				return;
+			sequence[c == BEL ? pos : pos - 1] = '\0';
+			promptmark(master, sequence + strlen(PROMPTMARK));
+		}
+		else if (escape < SEQUENCELEN - 1)
+			sequence[escape++] = c;
+		else {
+				/* too long: dropped up to its end */
+			escape = SEQUENCELEN;
+			sequence[escape - 1] = c;
+		}
+		return;
+	}
+
 				/* escape and special characters */
 
 	if (c <= 0x1F && c != ESCAPE &&
 	    c != '\b' && c != NL && c != FF && c != CR) {
-		putc(c, stdout);
+		if (flood && (c == BEL || c == TAB)) {
+			if (c == TAB)
+				col = (col / 8 + 1) * 8;
+			if (col > winsize.ws_col - 1)
+				col = winsize.ws_col - 1;
+			escape = -1;
+			utf8pos = 0;
+			stats.dropped++;
+			return;
+		}
+		if (flood)
+			leaveflood();
+		outputchar(c);
 		if (debug & DEBUGESCAPE)
 			putc(c, logescape);
 		escape = -1;
@@ -711,7 +5354,22 @@ void shelltoterminal(int master, unsigned char c) {
 		escape = 0;
 
 	if (escape >= 0) {
-		putc(c, stdout);
+		if (markheld == escape && c == PROMPTMARK[escape]) {
+			sequence[escape++] = c;
+			markheld++;
+			return;
+		}
+		markrelease();
+		if (flood && escape >= SEQUENCELEN - 1) {
+			sequence[escape] = '\0';
+			leaveflood();
+			outputstring(sequence);
+			stats.dropped -= escape;
+		}
+		if (! flood)
+			outputchar(c);
+		else
+			stats.dropped++;
 		if (escape >= SEQUENCELEN - 1) {
 			escape = -1;
 			positionstatus = POSITION_UNKNOWN;
@@ -733,6 +5391,16 @@ void shelltoterminal(int master, unsigned char c) {
 		if (debug & DEBUGESCAPE)
 			fprintf(logescape, "<%s>", sequence);
 
+		if (flood) {
+			if (floodsequence(sequence)) {
+				escape = -1;
+				return;
+			}
+			leaveflood();
+			outputstring(sequence);
+			stats.dropped -= escape;
+		}
+
 		if (! strcmp(sequence, ERASEDISPLAY))
 			erase(0, 0, winsize.ws_col);
 		else if (! strcmp(sequence, ERASECURSORDISPLAY)) {
@@ -740,7 +5408,7 @@ void shelltoterminal(int master, unsigned char c) {
 			erase(row, col, winsize.ws_col);
 		}
 		else if (! strcmp(sequence, ASKPOSITION)) {
-			fflush(stdout);
+			outputflush();
 			knowposition(master, 1);
 			sprintf(buf, ANSWERPOSITION, row + 1,
 				col < winsize.ws_col ? col + 1 : col);
@@ -759,10 +5427,22 @@ void shelltoterminal(int master, unsigned char c) {
 					kill(pid, SIGTERM);
 			}
 		}
-		else if (readposition(sequence, MOVECURSORTERMINATOR)) {
+		else if (! strcmp(sequence, BEGINSYNCHRONIZED)) {
+			beginsynchronized();
+			escape = -1;
+			return;
+		}
+		else if (! strcmp(sequence, ENDSYNCHRONIZED)) {
+			endsynchronized(0);
+			escape = -1;
+			return;
+		}
+		else if (movecursor(sequence)) {
 			escape = -1;
 			return;
 		}
+		else if (sequence[1] == '[' && c == 'm')
+			setattributes(sequence + 2);
 		escape = -1;
 		if (sequence[1] != '[' || (c != 'K' && c != 'm'))
 			positionstatus = POSITION_UNKNOWN;
@@ -773,7 +5453,10 @@ void shelltoterminal(int master, unsigned char c) {
 
 	if (utf8len == 0)
 		knowposition(master, 0);
-	putc(c, stdout);
+	if (! flood)
+		outputchar(c);
+	else
+		stats.dropped++;
 	if (debug & DEBUGESCAPE)
 		fprintf(logescape, "[pos:%d,%d]%c", row, col, c);
 
@@ -819,7 +5502,7 @@ void shelltoterminal(int master, unsigned char c) {
 	pos = (origin + row * winsize.ws_col + col) % buffersize;
 	if ((c == BS || c == DEL) && col > 0) {
 		col--;
-		buffer[(buffersize + pos - 1) % buffersize] = ' ';
+		recordcell((buffersize + pos - 1) % buffersize, ' ');
 	}
 	else if (c == NL || c == FF)
 		newrow(winsize);
@@ -827,18 +5510,944 @@ void shelltoterminal(int master, unsigned char c) {
 		col = 0;
 	else {
 		if (col >= winsize.ws_col) {
+			setwrapped(row, 1);
 			col = 0;
 			newrow(winsize);
 		}
-		buffer[pos] = w;
+		if (timedcell != origin + row * winsize.ws_col) {
+			timedcell = origin + row * winsize.ws_col;
+			timestamprow(timedcell / winsize.ws_col,
+				milliseconds());
+		}
+		recordcell(pos, w);
+		if (attribute != 0 || coloredrows > 0)
+			colorcell(row, col);
 		col++;
 	}
 	if (debug & DEBUGESCAPE)
 		fprintf(logescape, "[nextpos:%d,%d]", row, col);
+}
+
+/*
+ * check whether a character is the interrupt character of the shell; the
+ * character is taken from the pty again only when the shell wrote something
+ * since, or a second later, since a program changes the terminal settings
+ * before or after writing
+ */
+#define INTERRUPTCHECK 1000	/* milliseconds before taking it again */
+int interruptchar = -1;	/* interrupt character of the shell, -1 if none */
+int interruptstale = 1;	/* the shell wrote since interruptchar was taken */
+long long interrupttime;	/* when interruptchar was taken */
+int isinterrupt(int master, unsigned char c) {
+	struct termios st;
+	long long now;
+	int ch;
+
+	if (c >= 0x20 && c != DEL)
+		return 0;
+	now = milliseconds();
+	if (__atomic_exchange_n(&interruptstale, 0, __ATOMIC_ACQ_REL) ||
+	    now - __atomic_load_n(&interrupttime, __ATOMIC_RELAXED) >=
+	    INTERRUPTCHECK) {
+		ch = -1;
+		if (tcgetattr(master, &st) != -1 && (st.c_lflag & ISIG) &&
+		    st.c_cc[VINTR] != _POSIX_VDISABLE)
+			ch = st.c_cc[VINTR];
+		__atomic_store_n(&interruptchar, ch, __ATOMIC_RELAXED);
+		__atomic_store_n(&interrupttime, now, __ATOMIC_RELAXED);
+	}
+	return __atomic_load_n(&interruptchar, __ATOMIC_RELAXED) == c;
+}
+
+/*
+ * regular expressions: tree of nodes, program, classes of characters, dfa
+ */
+#define REGEXNODES 256
+#define REGEXRANGES 127
+#define REGEXPROG 512
+#define REGEXCLASSES 256
+#define DFASTATES 1024
+#define DFAPOOL (64 * 1024)
+#define RE_SET    0		/* a character among ranges */
+#define RE_CAT    1
+#define RE_ALT    2
+#define RE_STAR   3
+#define RE_PLUS   4
+#define RE_QUEST  5
+#define RE_BOL    6
+#define RE_EOL    7
+#define RE_EMPTY  8
+struct regexnode {
+	int type;
+	int left, right;	/* subexpressions, or first and last range */
+	int negate;		/* set of the characters not in the ranges */
+} regexnode[REGEXNODES];
+int regexnodes;
+u_int32_t regexrange[REGEXRANGES][2];
+int regexranges;
+int regexpos;		/* parsing position in searchstring */
+#define OP_SET    0
+#define OP_SPLIT  1
+#define OP_JMP    2
+#define OP_BOL    3
+#define OP_EOL    4
+#define OP_MATCH  5
+struct regexinst {
+	int op;
+	int x, y;		/* targets of jumps and splits */
+	u_int32_t classes[REGEXCLASSES / 32];	/* set: classes matched */
+} regexprog[REGEXPROG];
+int regexlen;
+u_int32_t regexbound[REGEXRANGES * 2];	/* first character of each class */
+int regexbounds;
+unsigned char regexascii[0x80];	/* class of each ascii character */
+int regexclasses;
+struct dfastate {
+	int first, count;	/* its instructions, in dfapool */
+	int bol;		/* at the start of a row */
+	int match;		/* a match ends here */
+	int matchend;		/* a match ends here if the row ends */
+} dfastate[DFASTATES];
+int dfastates;
+int dfapool[DFAPOOL];
+int dfapoolsize;
+int dfanext[DFASTATES * REGEXCLASSES];	/* transitions, -1 if not built */
+int dfastart;		/* state at the start of a row, -1 if not built */
+int dfaflushes;		/* times the states were dropped */
+int regexmark[REGEXPROG];	/* instructions already in a list */
+int regexgeneration;
+int regexlist[REGEXPROG];
+int regexlistlen;
+
+/*
+ * whether a character is special in regular expressions
+ */
+int regexspecial(u_int32_t c) {
+	return c < 0x80 && strchr(".[]()*+?|^$\\", c) != NULL && c != '\0';
+}
+
+/*
+ * new node of the tree
+ */
+int regexnew(int type, int left, int right) {
+	if (regexnodes >= REGEXNODES)
+		return -1;
+	regexnode[regexnodes].type = type;
+	regexnode[regexnodes].left = left;
+	regexnode[regexnodes].right = right;
+	regexnode[regexnodes].negate = 0;
+	return regexnodes++;
+}
+
+/*
+ * new range of characters
+ */
+int regexaddrange(u_int32_t low, u_int32_t high) {
+	if (regexranges >= REGEXRANGES)
+		return -1;
+	regexrange[regexranges][0] = low;
+	regexrange[regexranges][1] = high;
+	return regexranges++;
+}
+
+/*
+ * ranges of an escape like \d, or of the escaped character
+ */
+int regexescape(u_int32_t c) {
+	switch (c) {
+	case 'd':
+		return regexaddrange('0', '9');
+	case 's':
+		return regexaddrange(' ', ' ') == -1 ? -1 :
+			regexaddrange('\t', '\t');
+	case 'w':
+		return regexaddrange('a', 'z') == -1 ||
+		       regexaddrange('A', 'Z') == -1 ||
+		       regexaddrange('0', '9') == -1 ? -1 :
+			regexaddrange('_', '_');
+	default:
+		return regexaddrange(c, c);
+	}
+}
+
+/*
+ * parse an expression, an alternative, a concatenation, a repetition, an atom
+ */
+int regexalt();
+int regexatom() {
+	u_int32_t c;
+	int n, first;
+
+	c = searchstring[regexpos++];
+	if (c == '(') {
+		n = regexalt();
+		if (n == -1 || regexpos >= searchlen ||
+		    searchstring[regexpos++] != ')')
+			return -1;
+		return n;
+	}
+	if (c == '^')
+		return regexnew(RE_BOL, -1, -1);
+	if (c == '$')
+		return regexnew(RE_EOL, -1, -1);
+	if (c == '.') {
+		n = regexnew(RE_SET, regexranges, regexranges);
+		if (n == -1)
+			return -1;
+		regexnode[n].negate = 1;
+		return n;
+	}
+	first = regexranges;
+	if (c == '\\') {
+		if (regexpos >= searchlen ||
+		    regexescape(searchstring[regexpos++]) == -1)
+			return -1;
+		return regexnew(RE_SET, first, regexranges);
+	}
+	if (c != '[')
+		return regexspecial(c) || regexaddrange(c, c) == -1 ? -1 :
+			regexnew(RE_SET, first, regexranges);
+
+	n = regexnew(RE_SET, first, first);
+	if (n == -1)
+		return -1;
+	if (regexpos < searchlen && searchstring[regexpos] == '^') {
+		regexnode[n].negate = 1;
+		regexpos++;
+	}
+	do {
+		if (regexpos >= searchlen)
+			return -1;
+		c = searchstring[regexpos++];
+		if (c == '\\' && regexpos < searchlen) {
+			if (regexescape(searchstring[regexpos++]) == -1)
+				return -1;
+		}
+		else if (regexpos + 1 < searchlen &&
+		         searchstring[regexpos] == '-' &&
+		         searchstring[regexpos + 1] != ']') {
+			if (regexaddrange(c, searchstring[regexpos + 1]) == -1)
+				return -1;
+			regexpos += 2;
+		}
+		else if (regexaddrange(c, c) == -1)
+			return -1;
+	} while (regexpos >= searchlen || searchstring[regexpos] != ']');
+	regexpos++;
+	regexnode[n].right = regexranges;
+	return n;
+}
+int regexrepeat() {
+	int n;
+	u_int32_t c;
+
+	n = regexatom();
+	while (n != -1 && regexpos < searchlen) {
+		c = searchstring[regexpos];
+		if (c != '*' && c != '+' && c != '?')
+			break;
+		regexpos++;
+		n = regexnew(c == '*' ? RE_STAR : c == '+' ? RE_PLUS : RE_QUEST,
+			n, -1);
+	}
+	return n;
+}
+int regexcat() {
+	int n, m;
+
+	n = regexnew(RE_EMPTY, -1, -1);
+	while (n != -1 && regexpos < searchlen &&
+	       searchstring[regexpos] != '|' && searchstring[regexpos] != ')') {
+		m = regexrepeat();
+		n = m == -1 ? -1 : regexnew(RE_CAT, n, m);
+	}
+	return n;
+}
+int regexalt() {
+	int n, m;
+
+	n = regexcat();
+	while (n != -1 && regexpos < searchlen &&
+	       searchstring[regexpos] == '|') {
+		regexpos++;
+		m = regexcat();
+		n = m == -1 ? -1 : regexnew(RE_ALT, n, m);
+	}
+	return n;
+}
+
+/*
+ * class of a character
+ */
+int regexclass(u_int32_t c) {
+	int low, high, mid;
+
+	if (c < 0x80)
+		return regexascii[c];
+	low = 0;
+	high = regexbounds;
+	while (low < high) {
+		mid = (low + high) / 2;
+		if (regexbound[mid] <= c)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
+/*
+ * split the characters into classes, at the ends of the ranges
+ */
+int regexcompare(const void *a, const void *b) {
+	u_int32_t x = *(u_int32_t *) a, y = *(u_int32_t *) b;
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+void regexsplit() {
+	int i, n;
+
+	n = 0;
+	for (i = 0; i < regexranges; i++) {
+		regexbound[n++] = regexrange[i][0];
+		regexbound[n++] = regexrange[i][1] + 1;
+	}
+	qsort(regexbound, n, sizeof(u_int32_t), regexcompare);
+	regexbounds = 0;
+	for (i = 0; i < n; i++)
+		if (regexbounds == 0 ||
+		    regexbound[i] != regexbound[regexbounds - 1])
+			regexbound[regexbounds++] = regexbound[i];
+	regexclasses = regexbounds + 1;
+	regexbounds = 0;
+	for (i = 0; i < 0x80; i++) {
+		while (regexbounds < regexclasses - 1 &&
+		       regexbound[regexbounds] <= (u_int32_t) i)
+			regexbounds++;
+		regexascii[i] = regexbounds;
+	}
+	regexbounds = regexclasses - 1;
+}
+
+/*
+ * emit the instructions of a node
+ */
+int regexemit(int op, int x, int y) {
+	if (regexlen >= REGEXPROG)
+		return -1;
+	regexprog[regexlen].op = op;
+	regexprog[regexlen].x = x;
+	regexprog[regexlen].y = y;
+	return regexlen++;
+}
+int regexcode(int n) {
+	struct regexnode *e = &regexnode[n];
+	int i, j, c, in, pc, jmp;
+	u_int32_t first;
+
+	switch (e->type) {
+	case RE_EMPTY:
+		return 0;
+	case RE_BOL:
+		return regexemit(OP_BOL, 0, 0) == -1 ? -1 : 0;
+	case RE_EOL:
+		return regexemit(OP_EOL, 0, 0) == -1 ? -1 : 0;
+	case RE_SET:
+		pc = regexemit(OP_SET, 0, 0);
+		if (pc == -1)
+			return -1;
+		memset(regexprog[pc].classes, 0, sizeof(regexprog[pc].classes));
+		for (c = 0; c < regexclasses; c++) {
+			first = c == 0 ? 0 : regexbound[c - 1];
+			in = 0;
+			for (i = e->left; i < e->right; i++)
+				if (regexrange[i][0] <= first &&
+				    first <= regexrange[i][1])
+					in = 1;
+			if (in != e->negate)
+				regexprog[pc].classes[c / 32] |= 1U << c % 32;
+		}
+		return 0;
+	case RE_CAT:
+		return regexcode(e->left) == -1 ? -1 : regexcode(e->right);
+	case RE_ALT:
+		pc = regexemit(OP_SPLIT, 0, 0);
+		if (pc == -1 || regexcode(e->left) == -1)
+			return -1;
+		jmp = regexemit(OP_JMP, 0, 0);
+		if (jmp == -1)
+			return -1;
+		regexprog[pc].x = pc + 1;
+		regexprog[pc].y = regexlen;
+		if (regexcode(e->right) == -1)
+			return -1;
+		regexprog[jmp].x = regexlen;
+		return 0;
+	case RE_STAR:
+		pc = regexemit(OP_SPLIT, 0, 0);
+		if (pc == -1 || regexcode(e->left) == -1 ||
+		    regexemit(OP_JMP, pc, 0) == -1)
+			return -1;
+		regexprog[pc].x = pc + 1;
+		regexprog[pc].y = regexlen;
+		return 0;
+	case RE_PLUS:
+		pc = regexlen;
+		if (regexcode(e->left) == -1)
+			return -1;
+		j = regexemit(OP_SPLIT, pc, 0);
+		if (j == -1)
+			return -1;
+		regexprog[j].y = regexlen;
+		return 0;
+	case RE_QUEST:
+		pc = regexemit(OP_SPLIT, 0, 0);
+		if (pc == -1 || regexcode(e->left) == -1)
+			return -1;
+		regexprog[pc].x = pc + 1;
+		regexprog[pc].y = regexlen;
+		return 0;
+	}
+	return -1;
+}
+
+/*
+ * compile the string to search; return -1 if it is not a valid expression
+ */
+int regexcompile() {
+	int n;
+
+	regexnodes = 0;
+	regexranges = 0;
+	regexlen = 0;
+	regexpos = 0;
+	n = regexalt();
+	if (n == -1 || regexpos < searchlen)
+		return -1;
+	regexsplit();
+	if (regexcode(n) == -1 || regexemit(OP_MATCH, 0, 0) == -1)
+		return -1;
+	dfastates = 0;
+	dfapoolsize = 0;
+	dfastart = -1;
+	return 0;
+}
+
+/*
+ * add an instruction to the list, following jumps and splits; the anchors
+ * are passed only at the start or end of the row
+ */
+void regexadd(int pc, int bol, int eol) {
+	if (regexmark[pc] == regexgeneration)
+		return;
+	regexmark[pc] = regexgeneration;
+	switch (regexprog[pc].op) {
+	case OP_JMP:
+		regexadd(regexprog[pc].x, bol, eol);
+		return;
+	case OP_SPLIT:
+		regexadd(regexprog[pc].x, bol, eol);
+		regexadd(regexprog[pc].y, bol, eol);
+		return;
+	case OP_BOL:
+		if (bol)
+			regexadd(pc + 1, bol, eol);
+		return;
+	case OP_EOL:
+		if (eol)
+			regexadd(pc + 1, bol, eol);
+		else
+			regexlist[regexlistlen++] = pc;
+		return;
+	default:
+		regexlist[regexlistlen++] = pc;
+	}
+}
+void regexbegin() {
+	if (++regexgeneration == 0) {
+		memset(regexmark, 0, sizeof(regexmark));
+		regexgeneration = 1;
+	}
+	regexlistlen = 0;
+}
+
+/*
+ * whether the list contains a match, or would at the end of the row
+ */
+int regexmatched(int bol, int count, int *list, int eol) {
+	int i, n;
 
-	if (debug & DEBUGBUFFER) {
-		fseek(logbuffer, 0, SEEK_SET);
-		fwrite(buffer, sizeof(u_int32_t), buffersize, logbuffer);
+	for (i = 0; i < count; i++)
+		if (regexprog[list[i]].op == OP_MATCH)
+			return 1;
+	if (! eol)
+		return 0;
+	regexbegin();
+	for (i = 0; i < count; i++)
+		if (regexprog[list[i]].op == OP_EOL)
+			regexadd(list[i] + 1, bol, 1);
+	for (n = 0; n < regexlistlen; n++)
+		if (regexprog[regexlist[n]].op == OP_MATCH)
+			return 1;
+	return 0;
+}
+
+/*
+ * the dfa state of the current list, made if not already existing; all
+ * states are dropped when too many
+ */
+int intcompare(const void *a, const void *b) {
+	return *(int *) a - *(int *) b;
+}
+int dfafind(int bol) {
+	int s, list[REGEXPROG], count;
+
+	count = regexlistlen;
+	memcpy(list, regexlist, count * sizeof(int));
+	qsort(list, count, sizeof(int), intcompare);
+	for (s = 0; s < dfastates; s++)
+		if (dfastate[s].bol == bol && dfastate[s].count == count &&
+		    ! memcmp(dfapool + dfastate[s].first, list,
+		             count * sizeof(int)))
+			return s;
+	if (dfastates >= DFASTATES || dfapoolsize + count > DFAPOOL) {
+		dfastates = 0;
+		dfapoolsize = 0;
+		dfastart = -1;
+		dfaflushes++;
+	}
+	s = dfastates++;
+	dfastate[s].first = dfapoolsize;
+	dfastate[s].count = count;
+	dfastate[s].bol = bol;
+	memcpy(dfapool + dfapoolsize, list, count * sizeof(int));
+	dfapoolsize += count;
+	dfastate[s].match = regexmatched(bol, count, list, 0);
+	dfastate[s].matchend = regexmatched(bol, count, list, 1);
+	memset(dfanext + s * regexclasses, -1, regexclasses * sizeof(int));
+	return s;
+}
+
+/*
+ * state at the start of a row, and after a character
+ */
+int dfabegin() {
+	if (dfastart == -1) {
+		regexbegin();
+		regexadd(0, 1, 0);
+		dfastart = dfafind(1);
+	}
+	return dfastart;
+}
+int dfastep(int s, int class) {
+	int i, pc, t, flushes;
+
+	regexbegin();
+	for (i = 0; i < dfastate[s].count; i++) {
+		pc = dfapool[dfastate[s].first + i];
+		if (regexprog[pc].op == OP_SET &&
+		    regexprog[pc].classes[class / 32] & 1U << class % 32)
+			regexadd(pc + 1, 0, 0);
+	}
+	regexadd(0, 0, 0);
+	flushes = dfaflushes;
+	t = dfafind(0);
+	if (dfaflushes == flushes)
+		dfanext[s * regexclasses + class] = t;
+	return t;
+}
+
+/*
+ * whether the expression matches in a row of the buffer
+ */
+int regexrow(int pos) {
+	int s, t, i, class, matchend;
+	u_int32_t c;
+
+	s = dfabegin();
+	if (dfastate[s].match)
+		return 1;
+	matchend = dfastate[s].matchend;
+	for (i = 0; i < winsize.ws_col; i++) {
+		c = buffer[pos];
+		pos = pos + 1 == buffersize ? 0 : pos + 1;
+		class = regexclass(c);
+		t = dfanext[s * regexclasses + class];
+		s = t != -1 ? t : dfastep(s, class);
+		if (dfastate[s].match)
+			return 1;
+		if (c != ' ')
+			matchend = dfastate[s].matchend;
+	}
+	return matchend;
+}
+
+/*
+ * leftmost longest match in a row; the anchors are at the start of the row
+ * and after its last non-blank character
+ */
+void regexspan(int pos) {
+	int n, start, i, j, best, count, list[REGEXPROG];
+	int class;
+
+	n = winsize.ws_col;
+	while (n > 0 && buffer[(pos + n - 1) % buffersize] == ' ')
+		n--;
+	for (start = 0; start <= winsize.ws_col; start++) {
+		regexbegin();
+		regexadd(0, start == 0, 0);
+		best = -1;
+		for (i = start; ; i++) {
+			count = regexlistlen;
+			memcpy(list, regexlist, count * sizeof(int));
+			if (regexmatched(i == 0, count, list, i == n))
+				best = i;
+			if (i == winsize.ws_col || count == 0)
+				break;
+			class = regexclass(buffer[(pos + i) % buffersize]);
+			regexbegin();
+			for (j = 0; j < count; j++)
+				if (regexprog[list[j]].op == OP_SET &&
+				    regexprog[list[j]].classes[class / 32] &
+				    1U << class % 32)
+					regexadd(list[j] + 1, 0, 0);
+		}
+		if (best != -1) {
+			searchhit = pos + start;
+			searchhitlen = best - start;
+			return;
+		}
+	}
+	searchhit = pos;
+	searchhitlen = 0;
+}
+
+/*
+ * last row from the one of from back to the one of low where the expression
+ * matches; the match is in searchhit and searchhitlen
+ */
+int regexback(int from, int low) {
+	int pos;
+
+	for (pos = from - from % winsize.ws_col; pos >= low;
+	     pos -= winsize.ws_col)
+		if (regexrow(pos % buffersize)) {
+			regexspan(pos);
+			return searchhit;
+		}
+	return -1;
+}
+
+/*
+ * whether the string to search starts at a cell
+ */
+int searchat(int pos) {
+	int i;
+
+	for (i = 0; i < searchlen; i++)
+		if (buffer[(pos + i) % buffersize] != searchstring[i])
+			return 0;
+	return 1;
+}
+
+/*
+ * position of a trigram in the filters
+ */
+unsigned trigram(u_int32_t a, u_int32_t b, u_int32_t c) {
+	unsigned h;
+
+	h = a * 0x9E3779B1 ^ b * 0x85EBCA77 ^ c * 0xC2B2AE3D;
+	return (h ^ h >> 16) % INDEXBITS;
+}
+
+/*
+ * index a row that scrolled out of the screen, in the recorder thread; its
+ * trigrams are the ones starting in it, except the last two; these end in the
+ * next row, which may still change; the last two of the previous row are
+ * indexed instead; the trigrams of blanks only are not indexed
+ */
+void indexrow(int row) {
+	int start, end, last, pos, i, block;
+	struct indexblock *b;
+	u_int32_t c0, c1, c2;
+	unsigned h;
+
+	start = row * winsize.ws_col - 2;
+	end = start + winsize.ws_col;
+	if (start < 0)
+		start = 0;
+	i = (end + 1) % buffersize;
+	for (last = end + 1; last >= start; last--) {
+		if (buffer[i] != ' ')
+			break;
+		i = i == 0 ? buffersize - 1 : i - 1;
+	}
+	if (last < end)
+		end = last + 1;
+	i = start % buffersize;
+	c0 = buffer[i];
+	i = i + 1 == buffersize ? 0 : i + 1;
+	c1 = buffer[i];
+	i = i + 1 == buffersize ? 0 : i + 1;
+	b = NULL;
+	for (pos = start; pos < end; pos++) {
+		c2 = buffer[i];
+		i = i + 1 == buffersize ? 0 : i + 1;
+		block = pos / INDEXBLOCK;
+		if (b == NULL || b->block != block) {
+			b = &indexblocks[block % indexslots];
+			if (b->block != block) {
+				b->block = block;
+				memset(b->filter, 0, INDEXBITS / 8);
+			}
+		}
+		h = trigram(c0, c1, c2);
+		b->filter[h / 8] |= 1 << h % 8;
+		c0 = c1;
+		c1 = c2;
+	}
+	__atomic_store_n(&indexed, (row + 1) * winsize.ws_col - 2,
+		__ATOMIC_RELEASE);
+}
+
+/*
+ * whether a trigram is in the filter of a block, or may be
+ */
+int indexhas(int block, unsigned h) {
+	struct indexblock *b;
+
+	if ((block + 1) * INDEXBLOCK > indexed || block * INDEXBLOCK < indexlow)
+		return 1;
+	b = &indexblocks[block % indexslots];
+	return b->block != block || b->filter[h / 8] & 1 << h % 8;
+}
+
+/*
+ * whether the string to search may start in a block: a string starting in a
+ * block has its trigrams there or in the next, since it is shorter than a block
+ */
+int searchcandidate(int block) {
+	int i;
+	unsigned h;
+
+	for (i = 0; i + 2 < searchlen; i++) {
+		if (searchstring[i] == ' ' && searchstring[i + 1] == ' ' &&
+		    searchstring[i + 2] == ' ')
+			continue;
+		h = trigram(searchstring[i], searchstring[i + 1],
+			searchstring[i + 2]);
+		if (! indexhas(block, h) && ! indexhas(block + 1, h))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * last occurrence of the string to search that starts between low and from;
+ * findlast() scans the parts that do not cross the end of the buffer
+ */
+int searchrange(int from, int low) {
+	int base, start, pos, i;
+
+	while (from >= low) {
+		base = from - from % buffersize;
+		start = base > low ? base : low;
+		for (pos = from; pos >= start &&
+		     pos - base > buffersize - searchlen; pos--)
+			if (searchat(pos))
+				return pos;
+		if (pos >= start) {
+			i = findlast(buffer + start - base,
+				pos - start + searchlen,
+				searchstring, searchlen);
+			if (i != -1)
+				return start + i;
+		}
+		from = start - 1;
+	}
+	return -1;
+}
+
+/*
+ * same, only in the blocks that may contain the string
+ */
+int searchback(int from, int low) {
+	int block, start, pos;
+
+	stats.searchblocks = 0;
+	stats.searchskipped = 0;
+	for (block = from / INDEXBLOCK; from >= low; block--) {
+		start = block * INDEXBLOCK > low ? block * INDEXBLOCK : low;
+		stats.searchblocks++;
+		if (! searchcandidate(block))
+			stats.searchskipped++;
+		else {
+			pos = searchrange(from, start);
+			if (pos != -1)
+				return pos;
+		}
+		from = start - 1;
+	}
+	return -1;
+}
+
+/*
+ * whether a row contains the string to search
+ */
+int searchrow(int pos) {
+	int i;
+
+	if (searchregex)
+		return regexrow(pos);
+	for (i = 0; i + searchlen <= winsize.ws_col; i++)
+		if (searchat(pos + i))
+			return 1;
+	return 0;
+}
+
+/*
+ * search the string from searchfrom backwards, and show where it is
+ */
+void searchshow() {
+	int i, view, low, top, pos;
+	long long start;
+
+	searchlen = utf8tocells(searchstring, SEARCHLEN,
+		searchkeys, searchkeyslen);
+	searchregex = 0;
+	for (i = 0; i < searchlen; i++)
+		if (regexspecial(searchstring[i]))
+			searchregex = 1;
+	if (searchregex && regexcompile() == -1)
+		searchregex = -1;
+
+	view = (winsize.ws_row - 2) * winsize.ws_col;
+	low = bufferlow();
+	searchhit = -1;
+	if (searchlen > 0 && searchregex == 0) {
+		recordsync();
+		top = origin - winsize.ws_col + view - searchlen;
+		start = microseconds();
+		searchhit = searchback(searchfrom < top ? searchfrom : top,
+			low);
+		searchhitlen = searchlen;
+		stats.searchtime = microseconds() - start;
+	}
+	else if (searchlen > 0 && searchregex == 1) {
+		recordsync();
+		top = origin - winsize.ws_col + view - 1;
+		start = microseconds();
+		searchhit = regexback(searchfrom < top ? searchfrom : top, low);
+		stats.searchtime = microseconds() - start;
+	}
+
+	if (searchhit != -1) {
+		pos = searchhit - searchhit % winsize.ws_col -
+			(winsize.ws_row - 2) / 2 * winsize.ws_col;
+		if (pos > origin - winsize.ws_col)
+			pos = origin - winsize.ws_col;
+		if (pos < low)
+			pos = low;
+		show = pos;
+	}
+	showscrollback();
+}
+
+/*
+ * a key typed while searching
+ */
+void searchkey(unsigned char c) {
+	if (c == ESCAPE || c == CR) {
+		searching = 0;
+		searchhit = -1;
+		showscrollback();
+	}
+	else if (c == DEL || c == BS) {
+		while (searchkeyslen > 0 && ! singlechar &&
+		       (searchkeys[searchkeyslen - 1] & 0xC0) == 0x80)
+			searchkeyslen--;
+		if (searchkeyslen > 0)
+			searchkeyslen--;
+		searchshow();
+	}
+	else if (c >= 0x20 && searchkeyslen < SEARCHLEN) {
+		searchkeys[searchkeyslen++] = c;
+		searchshow();
+	}
+}
+
+/*
+ * first row printed at a date or later, binary search between two rows
+ */
+int timerow(long long date, int low, int high) {
+	int middle;
+	long long t;
+
+	while (low < high) {
+		middle = low + (high - low) / 2;
+		t = rowtime(middle);
+		if (t != -1 && t >= date)
+			high = middle;
+		else
+			low = middle + 1;
+	}
+	return low;
+}
+
+/*
+ * scroll to the rows printed some minutes ago
+ */
+void jumpshow() {
+	int low, pos;
+
+	low = bufferlow();
+	pos = timerow(milliseconds() - jumpminutes * 60000LL,
+		low / winsize.ws_col, origin / winsize.ws_col) *
+		winsize.ws_col;
+	if (pos > origin - winsize.ws_col)
+		pos = origin - winsize.ws_col;
+	if (pos < low)
+		pos = low;
+	show = pos;
+	showscrollback();
+}
+
+/*
+ * a key typed while entering the minutes to go back
+ */
+void jumpkey(unsigned char c) {
+	if (c == ESCAPE || c == CR) {
+		jumping = 0;
+		showscrollback();
+	}
+	else if (c == DEL || c == BS) {
+		jumpminutes /= 10;
+		jumpshow();
+	}
+	else if (c >= '0' && c <= '9' && jumpminutes < 1000000) {
+		jumpminutes = jumpminutes * 10 + c - '0';
+		jumpshow();
+	}
+}
+
+/*
+ * a key typed while entering the rows of the new buffer
+ */
+void sizekey(unsigned char c) {
+	if (c == ESCAPE || c == CR) {
+		sizing = 0;
+		if (c == CR && sizingrows > 0)
+			__atomic_store_n(&bufferrequest,
+				sizingrows * winsize.ws_col, __ATOMIC_SEQ_CST);
+		showscrollback();
+	}
+	else if (c == DEL || c == BS) {
+		sizingrows /= 10;
+		showscrollback();
+	}
+	else if (c >= '0' && c <= '9' &&
+	         sizingrows < INT_MAX / 8 / 10 / winsize.ws_col) {
+		sizingrows = sizingrows * 10 + c - '0';
+		showscrollback();
 	}
 }
 
@@ -849,8 +6458,8 @@ int special = -1;
 char specialsequence[SEQUENCELEN];
 void terminaltoshell(int master, unsigned char c, int next) {
 	int len;
-	int pos, size, all;
-	int rows;
+	char message[50];
+	int pos, size;
 
 	if (debug & DEBUGESCAPE)
 		putc(c, logescape);
@@ -871,18 +6480,30 @@ void terminaltoshell(int master, unsigned char c, int next) {
 		len = special;
 		special = -1;
 
+		if (snapshotshown > 0 &&
+		    ! strcmp(specialsequence, scrolldown)) {
+			snapshotstep(0);
+			return;
+		}
+		if (snapshotshown > 0 &&
+		    (! strcmp(specialsequence, KEYF9) ||
+		     ! strcmp(specialsequence, KEYF10))) {
+			snapshottop = strcmp(specialsequence, KEYF9) ? 2 : 0;
+			showsnapshot();
+			return;
+		}
+		if (snapshotshown > 0 && strcmp(specialsequence, KEYF8)) {
+			snapshotshown = 0;
+			showscrollback();
+		}
+
 		size = lines * winsize.ws_col;
 		if (! strcmp(specialsequence, scrollup)) {
 			pos = show - size;
-			if (pos < 0)
-				pos = 0;
-			all = winsize.ws_row * winsize.ws_col;
-			if (origin - pos > buffersize - all) {
-				rows = (buffersize - all) / winsize.ws_col;
-				pos = origin - rows * winsize.ws_col;
-			}
+			if (pos < bufferlow())
+				pos = bufferlow() < show ? bufferlow() : show;
 			if (show == origin && pos != show)
-				fprintf(stdout, SAVECURSOR);
+				outputstring(SAVECURSOR);
 			if (debug & DEBUGESCAPE)
 				fprintf(logescape, "[UP]");
 		}
@@ -893,13 +6514,90 @@ void terminaltoshell(int master, unsigned char c, int next) {
 					return;
 				pos = origin;
 			}
+			else if (pos < bufferlow())
+				pos = show;
 		}
 		else if (! strcmp(specialsequence, KEYF2) && show != origin) {
-			savebuffer(NULL);
+			savebuffer();
 			return;
 		}
 		else if (! strcmp(specialsequence, KEYF3) && show != origin) {
-			savebuffer("less");
+			pagebuffer(searching && searchlen > 0 &&
+				searchregex != -1);
+			return;
+		}
+		else if (! strcmp(specialsequence, KEYF5) && show != origin) {
+			savecommand();
+			return;
+		}
+		else if (! strcmp(specialsequence, KEYF6) && show != origin) {
+			showtimes = ! showtimes;
+			showscrollback();
+			if (showtimes) {
+				snprintf(message, sizeof(message),
+					"timestamps: %zu kB", timeslots *
+					sizeof(struct timeblock) / 1024);
+				notify(message);
+			}
+			return;
+		}
+		else if (! strcmp(specialsequence, KEYF7) && show != origin) {
+			searching = 0;
+			searchhit = -1;
+			sizing = 0;
+			jumping = 1;
+			jumpminutes = 0;
+			showscrollback();
+			return;
+		}
+		else if (! strcmp(specialsequence, KEYF8) && show != origin) {
+			searching = 0;
+			searchhit = -1;
+			jumping = 0;
+			sizing = 0;
+			snapshotstep(1);
+			return;
+		}
+		else if (! strcmp(specialsequence, KEYF1) && show != origin) {
+			searching = 0;
+			searchhit = -1;
+			jumping = 0;
+			sizing = 1;
+			sizingrows = 0;
+			showscrollback();
+			return;
+		}
+		else if (! strcmp(specialsequence, KEYF9) && show != origin) {
+			pos = markprompt(show, 0);
+			if (pos == -1 || pos < bufferlow()) {
+				notify("no previous prompt");
+				return;
+			}
+		}
+		else if (! strcmp(specialsequence, KEYF10) && show != origin) {
+			pos = markprompt(show + winsize.ws_col, 1);
+			if (pos == -1 || pos - origin > 0)
+				pos = origin;
+			else if (pos < bufferlow())
+				pos = show;
+		}
+		else if (! strcmp(specialsequence, KEYF4) && show != origin) {
+			if (! searching) {
+				jumping = 0;
+				sizing = 0;
+				searching = 1;
+				searchkeyslen = 0;
+				searchlen = 0;
+				searchfrom = show + (winsize.ws_row - 2) *
+					winsize.ws_col - 1;
+				searchshow();
+			}
+			else if (searchhit != -1) {
+				searchfrom = searchregex ? searchhit -
+					searchhit % winsize.ws_col - 1 :
+					searchhit - 1;
+				searchshow();
+			}
 			return;
 		}
 		else if (readposition(specialsequence, GETPOSITIONTERMINATOR))
@@ -916,64 +6614,650 @@ void terminaltoshell(int master, unsigned char c, int next) {
 		return;
 	}
 
+	if (searching) {
+		searchkey(c);
+		return;
+	}
+
+	if (jumping) {
+		jumpkey(c);
+		return;
+	}
+
+	if (sizing) {
+		sizekey(c);
+		return;
+	}
+
+	if (isinterrupt(master, c)) {
+		__atomic_store_n(&interrupted, 1, __ATOMIC_RELEASE);
+		tcflush(STDOUT_FILENO, TCOFLUSH);
+		if (debug & DEBUGESCAPE)
+			fprintf(logescape, "[interrupt]");
+	}
 	write(master, &c, 1);
 	return;
 }
 
+/*
+ * interrupt character typed: do not show the output still waiting
+ */
+void dropoutput(int master) {
+	if (flood == FLOOD_INTERRUPT || show != origin)
+		return;
+	if (backlog(master) < FLOODTHRESHOLD && outputlen < FLOODTHRESHOLD)
+		return;
+	knowposition(master, 0);
+	if (positionstatus != POSITION_KNOWN)
+		return;
+	stats.dropped += outputlen;
+	outputdiscard();
+	enterflood(FLOOD_INTERRUPT);
+	if (backlog(master) == 0)
+		leaveflood();
+}
+
+/*
+ * process the signals received
+ */
+void signals() {
+	struct signalfd_siginfo si;
+	int status, size;
+
+	while (read(signalfile, &si, sizeof(si)) == sizeof(si)) {
+		if (debug & DEBUGESCAPE)
+			fprintf(logescape, "[signal:%d]", si.ssi_signo);
+		switch (si.ssi_signo) {
+		case SIGCHLD:
+			if (waitpid(shellpid, NULL, WNOHANG) == shellpid)
+				shellexited = 1;
+			if (savepid != 0 &&
+			    waitpid(savepid, &status, WNOHANG) == savepid)
+				saved(status);
+			break;
+		case SIGTERM:
+			terminate = 1;
+			break;
+		case SIGWINCH:
+			resized = 1;
+			break;
+		case SIGUSR1:
+		case SIGUSR2:
+			size = __atomic_load_n(&bufferrequest,
+				__ATOMIC_SEQ_CST);
+			if (size == 0)
+				size = buffersize;
+			if (si.ssi_signo == SIGUSR2)
+				size /= 2;
+			else if (size <= INT_MAX / 8)
+				size *= 2;
+			__atomic_store_n(&bufferrequest, size,
+				__ATOMIC_SEQ_CST);
+			break;
+		}
+	}
+}
+
+/*
+ * process a block of data from the terminal
+ */
+void terminalblock(int master, char *buf, int len) {
+	int i;
+
+	if (debug & DEBUGESCAPE)
+		fprintf(logescape, "\nin[%d](", len);
+	for (i = 0; i < len; i++)
+		terminaltoshell(master, buf[i], i < len - 1);
+	if (debug & DEBUGESCAPE)
+		fprintf(logescape, ")\n");
+}
+
+/*
+ * wake a thread waiting on an eventfd
+ */
+void inputwake(int fd) {
+	u_int64_t one = 1;
+	write(fd, &one, sizeof(one));
+}
+
+/*
+ * input thread: stay paused while the main thread asks so; return whether
+ * to quit
+ */
+int inputwait() {
+	int quit;
+
+	pthread_mutex_lock(&inputmutex);
+	if (inputstate == INPUT_PAUSE) {
+		inputpaused = 1;
+		pthread_cond_broadcast(&inputcond);
+		while (inputstate == INPUT_PAUSE)
+			pthread_cond_wait(&inputcond, &inputmutex);
+		inputpaused = 0;
+	}
+	quit = inputstate == INPUT_QUIT;
+	pthread_mutex_unlock(&inputmutex);
+	return quit;
+}
+
+/*
+ * input thread: pass keys to the main thread, in order; when the ring is
+ * full and the main thread is about to run a program, wait for it to end
+ */
+void inputpush(char *data, int len) {
+	unsigned head;
+	int i;
+
+	head = inputhead;
+	while (head + len - __atomic_load_n(&inputtaken, __ATOMIC_ACQUIRE) >
+	       INPUTRING) {
+		if (__atomic_load_n(&inputstate, __ATOMIC_ACQUIRE) !=
+		    INPUT_RUN && inputwait())
+			return;
+		usleep(1000);
+	}
+	for (i = 0; i < len; i++)
+		inputring[(head + i) % INPUTRING] = data[i];
+	__atomic_store_n(&inputhead, head + len, __ATOMIC_RELEASE);
+	inputwake(inputevent);
+}
+
+/*
+ * input thread: end of the key sequence starting at buf[start], -1 if the
+ * block ends first; same rules as terminaltoshell()
+ */
+int inputsequence(char *buf, int start, int len) {
+	int i;
+	unsigned char c;
+
+	for (i = start + 1; i < len && i - start < SEQUENCELEN - 1; i++) {
+		c = buf[i];
+		if (c == '[' && i - start == 1)
+			continue;
+		if (c == '[' && i - start == 2 && buf[start + 1] == '[')
+			continue;
+		if ((c < 0x40 && c != '.' && c != 0x09) || c > 0x7F)
+			continue;
+		return i + 1;
+	}
+	return -1;
+}
+
+/*
+ * input thread: whether a key sequence is for scrollback
+ */
+int inputintercepted(char *seq, int len) {
+	if (seq[len - 1] == GETPOSITIONTERMINATOR)
+		return 1;
+	if (len == (int) strlen(scrollup) && ! memcmp(seq, scrollup, len))
+		return 1;
+	if (len == (int) strlen(scrolldown) && ! memcmp(seq, scrolldown, len))
+		return 1;
+	return 0;
+}
+
+/*
+ * input thread: forward a block of keys to the shell
+ */
+void inputkeys(int master, char *buf, int len) {
+	int i, end;
+
+	if (__atomic_load_n(&scrolled, __ATOMIC_ACQUIRE) ||
+	    inputhead != __atomic_load_n(&inputtail, __ATOMIC_ACQUIRE)) {
+		inputpush(buf, len);
+		return;
+	}
+
+	for (i = 0; i < len; i++) {
+		if (buf[i] == ESCAPE && i < len - 1) {
+			end = inputsequence(buf, i, len);
+			if (end == -1 || inputintercepted(buf + i, end - i)) {
+				if (i > 0)
+					write(master, buf, i);
+				inputpush(buf + i, len - i);
+				return;
+			}
+			i = end - 1;
+		}
+		else if (isinterrupt(master, buf[i])) {
+			__atomic_store_n(&interrupted, 1, __ATOMIC_RELEASE);
+			tcflush(STDOUT_FILENO, TCOFLUSH);
+			inputwake(inputevent);
+		}
+	}
+	write(master, buf, len);
+}
+
+/*
+ * input thread: read the terminal
+ */
+void *inputloop(void *arg) {
+	struct pollfd pfd[2];
+	char buf[BLOCKSIZE];
+	u_int64_t n;
+	int len, quit;
+
+	(void) arg;
+	pfd[0].fd = STDIN_FILENO;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = inputcontrol;
+	pfd[1].events = POLLIN;
+	quit = 0;
+	while (! quit) {
+		if (poll(pfd, 2, -1) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (pfd[1].revents) {
+			read(inputcontrol, &n, sizeof(n));
+			quit = inputwait();
+			continue;
+		}
+
+		if (! pfd[0].revents)
+			continue;
+		len = read(STDIN_FILENO, buf, BLOCKSIZE);
+		if (len == -1 && (errno == EINTR || errno == EAGAIN))
+			continue;
+		if (len <= 0) {
+			__atomic_store_n(&inputfailed, 1, __ATOMIC_RELEASE);
+			inputwake(inputevent);
+			break;
+		}
+		inputkeys(inputmaster, buf, len);
+	}
+
+	pthread_mutex_lock(&inputmutex);
+	inputpaused = 1;
+	pthread_cond_broadcast(&inputcond);
+	pthread_mutex_unlock(&inputmutex);
+	return NULL;
+}
+
+/*
+ * start the input thread
+ */
+int inputstart(int master) {
+	inputmaster = master;
+	inputhead = 0;
+	inputtaken = 0;
+	inputtail = 0;
+	inputdepth = 0;
+	inputready = 0;
+	inputfailed = 0;
+	inputpaused = 0;
+	inputstate = INPUT_RUN;
+	scrolled = 0;
+	inputevent = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	inputcontrol = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (inputevent == -1 || inputcontrol == -1)
+		return -1;
+	return pthread_create(&inputthread, NULL, inputloop, NULL) ? -1 : 0;
+}
+
+/*
+ * change the state of the input thread
+ */
+void inputrequest(int state) {
+	pthread_mutex_lock(&inputmutex);
+	inputstate = state;
+	pthread_cond_broadcast(&inputcond);
+	pthread_mutex_unlock(&inputmutex);
+	inputwake(inputcontrol);
+}
+
+/*
+ * stop reading the terminal, before a program is run on it
+ */
+void inputpause() {
+	inputrequest(INPUT_PAUSE);
+	pthread_mutex_lock(&inputmutex);
+	while (! inputpaused)
+		pthread_cond_wait(&inputcond, &inputmutex);
+	pthread_mutex_unlock(&inputmutex);
+}
+
+/*
+ * read the terminal again
+ */
+void inputresume() {
+	pthread_mutex_lock(&inputmutex);
+	inputstate = INPUT_RUN;
+	pthread_cond_broadcast(&inputcond);
+	pthread_mutex_unlock(&inputmutex);
+}
+
+/*
+ * terminate the input thread
+ */
+void inputstop() {
+	inputrequest(INPUT_QUIT);
+	pthread_join(inputthread, NULL);
+	close(inputcontrol);
+	close(inputevent);
+}
+
+/*
+ * process the keys passed by the input thread
+ */
+int inputblock(int master) {
+	char buf[INPUTRING];
+	unsigned head, len, i;
+	u_int64_t n;
+
+	inputready = 0;
+	read(inputevent, &n, sizeof(n));
+	if (__atomic_load_n(&inputfailed, __ATOMIC_ACQUIRE))
+		return -1;
+
+	head = __atomic_load_n(&inputhead, __ATOMIC_ACQUIRE);
+	len = head - inputtaken;
+	for (i = 0; i < len; i++)
+		buf[i] = inputring[(inputtaken + i) % INPUTRING];
+	__atomic_store_n(&inputtaken, head, __ATOMIC_RELEASE);
+
+	inputdepth++;
+	terminalblock(master, buf, len);
+	inputdepth--;
+
+	__atomic_store_n(&scrolled, show != origin, __ATOMIC_RELEASE);
+	if (inputdepth == 0)
+		__atomic_store_n(&inputtail, inputtaken, __ATOMIC_RELEASE);
+	return len > 0;
+}
+
+/*
+ * process a block of data from the shell
+ */
+void shellblock(int master, char *buf, int len) {
+	int i;
+
+	stats.shellbytes += len;
+	__atomic_store_n(&interruptstale, 1, __ATOMIC_RELEASE);
+	if (microseconds() >= nextsnapshot)
+		snapshot();
+	if (framerate && ! flood && show == origin &&
+	    positionstatus == POSITION_KNOWN &&
+	    backlog(master) >= FLOODTHRESHOLD)
+		enterflood(FLOOD_RATE);
+	for (i = 0; i < len; i++)
+		shelltoterminal(master, buf[i]);
+	if (flood) {
+		if (backlog(master) < FLOODTHRESHOLD)
+			leaveflood();
+		else if (microseconds() >= nextframe)
+			frame();
+	}
+	recordkick();
+	if (! synchronized)
+		outputflush();
+	else
+		stats.collapsed++;
+	__atomic_store_n(&scrolled, show != origin, __ATOMIC_RELEASE);
+}
+
+/*
+ * process an event on a file descriptor other than terminal and shell
+ */
+void otherevent(int fd) {
+	eventfd_t value;
+
+	if (fd == inputevent)
+		inputready = 1;
+	else if (fd == signalfile)
+		signals();
+	else if (fd == querytimer) {
+		readtimer(querytimer);
+		querytimeout = 1;
+		if (debug & DEBUGESCAPE)
+			fprintf(logescape, "[timeout]");
+	}
+	else if (fd == flushtimer) {
+		readtimer(flushtimer);
+		endsynchronized(1);
+	}
+	else if (fd == reflowevent) {
+		reflowend(0);
+		if (show != origin && snapshotshown == 0) {
+			showscrollback();
+			if (reflowjob.move)
+				buffernotice();
+		}
+	}
+	else if (fd == bufferevent)
+		eventfd_read(bufferevent, &value);
+}
+
+/*
+ * account the time taken to process a wakeup
+ */
+void latency(long long start, int work) {
+	long long elapsed;
+
+	if (! work)
+		stats.idle++;
+	elapsed = microseconds() - start;
+	stats.latency += elapsed;
+	if (elapsed > stats.maxlatency)
+		stats.maxlatency = elapsed;
+}
+
+/*
+ * process the completions of io_uring requests
+ */
+int uringcomplete() {
+	struct io_uring_cqe *cqe;
+	struct epoll_event events[MAXEVENTS];
+	unsigned head;
+	int res, failed, n, i;
+
+	failed = 0;
+	head = *cq.head;
+	while (head != __atomic_load_n(cq.tail, __ATOMIC_ACQUIRE)) {
+		cqe = &cq.cqes[head & *cq.mask];
+		res = cqe->res;
+		switch (cqe->user_data) {
+		case URING_SHELL:
+			shellinflight = 0;
+			if (res > 0)
+				shellstash = res;
+			else if (res != -ECANCELED && res != -EINTR &&
+			         res != -EAGAIN)
+				failed = 1;
+			break;
+		case URING_WRITE:
+			writeinflight = 0;
+			if (res > 0)
+				writingoff += res;
+			else if (res != -EINTR && res != -EAGAIN)
+				writingoff = writinglen;
+			if (writingoff >= writinglen) {
+				writinglen = 0;
+				writingoff = 0;
+			}
+			break;
+		case URING_EVENTS:
+			eventsinflight = 0;
+			stats.syscalls++;
+			n = epoll_wait(epollfd, events, MAXEVENTS, 0);
+			for (i = 0; i < n; i++)
+				otherevent(events[i].data.fd);
+			break;
+		}
+		head++;
+	}
+	__atomic_store_n(cq.head, head, __ATOMIC_RELEASE);
+
+	if (failed && debug & DEBUGESCAPE)
+		fprintf(logescape, "[uring read failed]");
+	return failed ? -1 : 0;
+}
+
+/*
+ * exchange one block of data between terminal and shell, with io_uring
+ */
+int exchangeuring(int master, int readshell) {
+	struct io_uring_sqe *sqe;
+	long long start;
+	int res, len;
+
+	if (debug & DEBUGESCAPE)
+		fprintf(logescape, "[exchangeuring(%d)]", readshell);
+
+	if (synchronized && outputlen >= OUTPUTLIMIT)
+		endsynchronized(1);
+
+	if (! shellinflight && shellstash == -1 &&
+	    outputlen + writinglen < OUTPUTLIMIT) {
+		sqe = uringsqe(IORING_OP_READ_FIXED, master,
+			uringbuffer, BLOCKSIZE, URING_SHELL);
+		sqe->buf_index = 0;
+		shellinflight = 1;
+	}
+	if (! eventsinflight) {
+		sqe = uringsqe(IORING_OP_POLL_ADD, epollfd, NULL, 0,
+			URING_EVENTS);
+		sqe->poll32_events = POLLIN;
+		eventsinflight = 1;
+	}
+	if (! synchronized)
+		outputflush();
+
+	if (! inputready && (! readshell || shellstash < 0)) {
+		res = uringenter(! shellexited);
+		if (res == -1 && errno != EINTR) {
+			if (debug & DEBUGESCAPE)
+				fprintf(logescape, "[errno=%d]", errno);
+			return -1;
+		}
+	}
+	start = microseconds();
+	stats.wakeups++;
+
+	if (uringcomplete() == -1)
+		return -1;
+	if (terminate)
+		return -1;
+	if (readshell && resized && ! moving())
+		resize(master);
+	if (shellexited && shellstash == -1 && backlog(master) == 0)
+		return -1;
+
+	res = 0;
+	if (inputready) {
+		res = inputblock(master);
+		if (res == -1)
+			return -1;
+	}
+
+	if (readshell && __atomic_exchange_n(&interrupted, 0, __ATOMIC_ACQ_REL))
+		dropoutput(master);
+	if (readshell && __atomic_load_n(&bufferrequest, __ATOMIC_SEQ_CST) &&
+	    ! moving())
+		bufferresize(__atomic_exchange_n(&bufferrequest, 0,
+			__ATOMIC_SEQ_CST));
+
+	if (readshell && shellstash >= 0) {
+		len = shellstash;
+		shellstash = -2;
+		shellblock(master, uringbuffer, len);
+		shellstash = -1;
+		res = 1;
+	}
+
+	latency(start, res);
+	return 0;
+}
+
 /*
  * exchange one block of data between terminal and shell
  */
-int exchange(int master, int readshell, struct timeval *timeout) {
-	fd_set sin;
-	char buf[1024];
+int exchange(int master, int readshell) {
+	struct epoll_event events[MAXEVENTS];
+	int shellready, outputready;
+	char buf[BLOCKSIZE];
 	int len, i;
 	int res;
+	long long start;
+	int work;
+
+	if (uring != -1)
+		return exchangeuring(master, readshell);
 
 	if (debug & DEBUGESCAPE)
 		fprintf(logescape, "[exchange(%d)]", readshell);
 
-	FD_ZERO(&sin);
-	FD_SET(STDIN_FILENO, &sin);
-	if (readshell)
-		FD_SET(master, &sin);
+	if (synchronized && outputlen >= OUTPUTLIMIT)
+		endsynchronized(1);
 
-	res = select(master + 1, &sin, NULL, NULL, timeout);
+	watch(master, readshell && outputlen < OUTPUTLIMIT ? EPOLLIN : 0,
+		&masterevents);
+	watch(outputfd, outputlen > 0 && ! synchronized ? EPOLLOUT : 0,
+		&outputevents);
+
+	stats.syscalls++;
+	res = epoll_wait(epollfd, events, MAXEVENTS, shellexited ? 0 : -1);
 	if (res == -1) {
 		if (debug & DEBUGESCAPE)
 			fprintf(logescape, "[errno=%d]", errno);
-		return res;
+		return errno == EINTR ? 0 : -1;
+	}
+	start = microseconds();
+	stats.wakeups++;
+	work = 0;
+
+	shellready = 0;
+	outputready = 0;
+	for (i = 0; i < res; i++) {
+		if (events[i].data.fd == master)
+			shellready = 1;
+		else if (events[i].data.fd == outputfd)
+			outputready = 1;
+		else
+			otherevent(events[i].data.fd);
 	}
 
-	if (res == 0)
-		if (debug & DEBUGESCAPE)
-			fprintf(logescape, "[timeout]");
+	if (terminate)
+		return -1;
+	if (shellexited && res == 0)
+		return -1;
+	if (readshell && resized && ! moving())
+		resize(master);
 
-	if (FD_ISSET(STDIN_FILENO, &sin)) {
-		len = read(STDIN_FILENO, &buf, 1024);
-		if (len == -1) {
-			if (debug & DEBUGESCAPE) {
-				fprintf(logescape, "\n[read:%d=", errno);
-				fprintf(logescape, "%s]\n", strerror(errno));
-			}
+	if (outputready) {
+		len = outputlen;
+		outputflush();
+		work |= len != outputlen;
+	}
+
+	if (inputready) {
+		len = inputblock(master);
+		if (len == -1)
 			return -1;
-		}
-		if (debug & DEBUGESCAPE)
-			fprintf(logescape, "\nin[%d](", len);
-		for (i = 0; i < len; i++)
-			terminaltoshell(master, buf[i], i < len - 1);
-		if (debug & DEBUGESCAPE)
-			fprintf(logescape, ")\n");
+		work |= len;
 	}
 
-	if (readshell && FD_ISSET(master, &sin)) {
-		len = read(master, &buf, 1024);
+	if (readshell && __atomic_exchange_n(&interrupted, 0, __ATOMIC_ACQ_REL))
+		dropoutput(master);
+	if (readshell && __atomic_load_n(&bufferrequest, __ATOMIC_SEQ_CST) &&
+	    ! moving())
+		bufferresize(__atomic_exchange_n(&bufferrequest, 0,
+			__ATOMIC_SEQ_CST));
+
+	if (readshell && shellready) {
+		stats.syscalls++;
+		len = read(master, &buf, BLOCKSIZE);
+		if (len == -1 && errno == EAGAIN)
+			return 0;
 		if (len == -1)
 			return -1;
-		for (i = 0; i < len; i++)
-			shelltoterminal(master, buf[i]);
-		fflush(stdout);
+		work = 1;
+		shellblock(master, buf, len);
 	}
 
+	latency(start, work);
 	return 0;
 }
 
@@ -997,37 +7281,249 @@ FILE *logopen(char *filename) {
 	return ret;
 }
 
+/*
+ * print statistics
+ */
+void printstats(FILE *fd) {
+	double seconds, megabytes, cpu, maincpu;
+	struct rusage ru;
+
+	seconds = (microseconds() - stats.start) / 1000000.0;
+	megabytes = stats.shellbytes / (1024.0 * 1024.0);
+	getrusage(RUSAGE_SELF, &ru);
+	cpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1000000.0 +
+	      ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1000000.0;
+	getrusage(RUSAGE_THREAD, &ru);
+	maincpu = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1000000.0 +
+	          ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1000000.0;
+	fprintf(fd, "seconds: %.3f\n", seconds);
+	fprintf(fd, "bytes from shell: %lld\n", stats.shellbytes);
+	fprintf(fd, "bytes per second: %.0f\n",
+		seconds > 0 ? stats.shellbytes / seconds : 0);
+	fprintf(fd, "bytes dropped by flooding: %lld\n", stats.dropped);
+	fprintf(fd, "flooding frames: %lld\n", stats.frames);
+	fprintf(fd, "synchronized updates: %lld\n", stats.syncframes);
+	fprintf(fd, "synchronized timeouts: %lld\n", stats.synctimeouts);
+	fprintf(fd, "blocks collapsed: %lld\n", stats.collapsed);
+	fprintf(fd, "wakeups: %lld\n", stats.wakeups);
+	fprintf(fd, "idle wakeups: %lld\n", stats.idle);
+	fprintf(fd, "average latency: %lld usec\n",
+		stats.wakeups ? stats.latency / stats.wakeups : 0);
+	fprintf(fd, "maximal latency: %lld usec\n", stats.maxlatency);
+	fprintf(fd, "system calls: %lld\n", stats.syscalls);
+	fprintf(fd, "last save: %lld usec, %d processes\n",
+		stats.savetime, stats.saveprocesses);
+	fprintf(fd, "last save blocked for: %lld usec\n", stats.savefork);
+	fprintf(fd, "last search: %lld usec, %d of %d blocks skipped\n",
+		stats.searchtime, stats.searchskipped, stats.searchblocks);
+	fprintf(fd, "journal: %lld bytes, %lld syncs, %lld lost\n",
+		stats.journalbytes, stats.journalsyncs, stats.journallost);
+	fprintf(fd, "timestamps: %zu bytes\n",
+		timeslots * sizeof(struct timeblock));
+	fprintf(fd, "screen snapshots: %d, %lld bytes of changes\n",
+		snapshotlast - snapshotfirst,
+		snapshotlast == snapshotfirst ? 0 :
+		snapshotend - snapshots[snapshotfirst % SNAPSHOTS].start);
+	fprintf(fd, "attribute sets: %d, %lld not stored\n",
+		attributecount, stats.attributeslost);
+	fprintf(fd, "attribute spans: %d, %zu bytes\n", spanlast - spanfirst,
+		(spanlast - spanfirst) * sizeof(struct span));
+	fprintf(fd, "resizes: %d, last stopped for %lld usec\n",
+		stats.resizes, stats.resizetime);
+	fprintf(fd, "last reflow: %d rows in %lld usec\n",
+		stats.reflowrows, stats.reflowtime);
+	fprintf(fd, "buffer size: %d cells, changed %d times, "
+		"last stopped for %lld usec\n",
+		buffersize, stats.buffersizes, stats.buffertime);
+	fprintf(fd, "last move: %d rows in %lld usec\n",
+		stats.moverows, stats.movetime);
+	fprintf(fd, "cpu seconds: %.3f\n", cpu);
+	fprintf(fd, "cpu seconds in the main thread: %.3f\n", maincpu);
+	if (megabytes > 0) {
+		fprintf(fd, "system calls per MB: %.0f\n",
+			stats.syscalls / megabytes);
+		fprintf(fd, "cpu seconds per MB: %.4f\n", cpu / megabytes);
+	}
+}
+
 /*
  * parent: main loop
  */
 void parent(int master, pid_t pid) {
 	int i;
-
-	(void) pid;
+	sigset_t mask;
+	unsigned inputevents, signalevents, queryevents, flushevents;
+	unsigned reflowevents, bufferevents;
 
 	if (debug & DEBUGESCAPE)
 		logescape = logopen(LOGESCAPE);
 	if (debug & DEBUGBUFFER)
 		logbuffer = logopen(LOGBUFFER);
+	if (debug & DEBUGSTATS)
+		logstats = logopen(LOGSTATS);
 
 	disablelinebuffering();
 	buffer = malloc(sizeof(u_int32_t) * buffersize);
 	for (i = 0; i < buffersize; i++)
 		buffer[i] = ' ';
+	wrappedrows = buffersize / winsize.ws_col + 1;
+	wrapped = calloc(wrappedrows, 1);
+	indexslots = buffersize / INDEXBLOCK + 3;
+	indexblocks = malloc(indexslots * sizeof(struct indexblock));
+	for (i = 0; i < indexslots; i++)
+		indexblocks[i].block = -1;
+	indexed = 0;
+	indexlow = 0;
+	timeslots = wrappedrows / TIMEBLOCK + 2;
+	timeblocks = malloc(timeslots * sizeof(struct timeblock));
+	for (i = 0; i < timeslots; i++)
+		timeblocks[i].block = -1;
+	timezoneupdate();
+	for (i = 0; i < winsize.ws_row; i++)
+		timestamprow(i, milliseconds());
+	timedcell = -1;
+	showtimes = 0;
+	jumping = 0;
+	snapshotscreen = malloc(sizeof(u_int32_t) *
+		winsize.ws_row * winsize.ws_col);
+	snapshotview = malloc(sizeof(u_int32_t) *
+		winsize.ws_row * winsize.ws_col);
+	snapshotchanges = malloc(8 * winsize.ws_row * winsize.ws_col + 16);
+	for (i = 0; i < winsize.ws_row * winsize.ws_col; i++)
+		snapshotscreen[i] = ' ';
+	snapshotfirst = 0;
+	snapshotlast = 0;
+	snapshotend = 0;
+	snapshotdate = milliseconds();
+	nextsnapshot = 0;
+	snapshotshown = 0;
+	memset(attributehash, 0, sizeof(attributehash));
+	attributecount = 0;
+	memset(&current, 0, sizeof(current));
+	attribute = attributeindex(&current);
+	screenattr = calloc(winsize.ws_row * winsize.ws_col,
+		sizeof(unsigned short));
+	rowcolored = calloc(winsize.ws_row, 1);
+	rowattrs = malloc(winsize.ws_col * sizeof(unsigned short));
+	coloredrows = 0;
+	screentop = 0;
+	spanslots = buffersize / 8 + 256;
+	spans = malloc(spanslots * sizeof(struct span));
+	spanfirst = 0;
+	spanlast = 0;
+	spanrows = 0;
+	shadow = malloc(sizeof(u_int32_t) * winsize.ws_row * winsize.ws_col);
+	resized = 0;
+	geometry = 0;
+	renumbered = 0;
+	rowbase = 0;
+	reflowing = 0;
+	reflowlow = 0;
+	bufferrequest = 0;
+	sizing = 0;
 	origin = 0;
 	show = 0;
+	searching = 0;
+	searchhit = -1;
+	markfirst = 0;
+	marklast = 0;
+	markheld = 0;
 	positionstatus = POSITION_UNKNOWN;
+	flood = FLOOD_NONE;
+	interrupted = 0;
+	synchronized = 0;
+	uring = -1;
+	if (useuring && uringsetup() == -1)
+		fprintf(stderr, "io_uring not available, using epoll\r\n");
+	outputopen();
 	deletescript(0);
-
-	while (exchange(master, 1, NULL) == 0) {
+	stats.start = microseconds();
+
+	shellpid = pid;
+	shellexited = 0;
+	terminate = 0;
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGCHLD);
+	sigaddset(&mask, SIGWINCH);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGUSR2);
+	sigprocmask(SIG_BLOCK, &mask, &signalmask);
+	signalfile = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+	querytimer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	flushtimer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	reflowevent = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	bufferevent = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	epollfd = epoll_create1(EPOLL_CLOEXEC);
+	if (signalfile == -1 || querytimer == -1 || flushtimer == -1 ||
+	    reflowevent == -1 || bufferevent == -1 || epollfd == -1) {
+		perror("event loop");
+		exit(EXIT_FAILURE);
+	}
+	inputevents = 0;
+	signalevents = 0;
+	queryevents = 0;
+	flushevents = 0;
+	reflowevents = 0;
+	bufferevents = 0;
+	masterevents = 0;
+	outputevents = 0;
+	if (inputstart(master) == -1 || recorderstart() == -1) {
+		perror("thread");
+		exit(EXIT_FAILURE);
+	}
+	if (journalstart() == -1) {
+		perror(journalpath);
+		exit(EXIT_FAILURE);
+	}
+	if (controlstart() == -1) {
+		perror(controlpath);
+		exit(EXIT_FAILURE);
+	}
+	watch(inputevent, EPOLLIN, &inputevents);
+	watch(signalfile, EPOLLIN, &signalevents);
+	watch(querytimer, EPOLLIN, &queryevents);
+	watch(flushtimer, EPOLLIN, &flushevents);
+	watch(reflowevent, EPOLLIN, &reflowevents);
+	watch(bufferevent, EPOLLIN, &bufferevents);
+
+	while (exchange(master, 1) == 0) {
 	}
 
+	if (terminate)
+		kill(shellpid, SIGHUP);
+
+	reflowend(1);
+	inputstop();
+	recorderstop();
+	controlstop();
+	journalstop();
+	outputdrain();
+	outputclose();
+	uringclose();
+
+	if (debug & DEBUGSTATS)
+		printstats(logstats);
+
+	close(epollfd);
+	close(reflowevent);
+	close(bufferevent);
+	close(flushtimer);
+	close(querytimer);
+	close(signalfile);
+	sigprocmask(SIG_SETMASK, &signalmask, NULL);
+
+	free(output);
+	free(writing);
+	free(shadow);
 	free(buffer);
 
 	if (debug & DEBUGESCAPE)
 		fclose(logescape);
 	if (debug & DEBUGBUFFER)
 		fclose(logbuffer);
+	if (debug & DEBUGSTATS)
+		fclose(logstats);
 }
 
 /*
@@ -1076,13 +7572,20 @@ int main(int argn, char *argv[]) {
 
 	buffersize = 32 * 1024;
 	linestring = NULL;
+	framerate = 0;
+	useuring = 0;
+	outputfd = STDOUT_FILENO;
+	journalpath = NULL;
+	control = 0;
+	timestamps = 0;
+	colors = 0;
 	singlechar = -1;
 	vtforward = 0;
 	checkonly = 0;
 	keysonly = 0;
 	debug = 0;
 	usage = 0;
-	while (-1 != (opt = getopt(argn, argv, "b:l:usvckd:h"))) {
+	while (-1 != (opt = getopt(argn, argv, "b:l:r:ij:qTausvckd:h"))) {
 		switch (opt) {
 		case 'b':
 			buffersize = atoi(optarg);
@@ -1090,6 +7593,24 @@ int main(int argn, char *argv[]) {
 		case 'l':
 			linestring = optarg;
 			break;
+		case 'r':
+			framerate = atoi(optarg);
+			break;
+		case 'i':
+			useuring = 1;
+			break;
+		case 'j':
+			journalpath = optarg;
+			break;
+		case 'q':
+			control = 1;
+			break;
+		case 'T':
+			timestamps = 1;
+			break;
+		case 'a':
+			colors = 1;
+			break;
 		case 'u':
 			singlechar = 0;
 			break;
@@ -1121,17 +7642,25 @@ int main(int argn, char *argv[]) {
 	}
 	if (usage) {
 		printf("usage:\n\t%s ", argv[0]);
-		printf("[-b buffersize] [-l lines] [-u] [-s] [-v] [-c] [-k]\n");
-		printf("\t\t\t[-d level] [-h] ");
+		printf("[-b buffersize] [-l lines] [-r rate] [-i]\n");
+		printf("\t\t\t[-j journal] [-q] [-T] [-a] [-u] [-s] [-v] ");
+		printf("[-c] [-k] [-d level] [-h]\n\t\t\t");
 		printf("/path/to/shell [-- shellargs...]\n");
 		printf("\t\t-b buffersize\tsize of scrollback buffer\n");
 		printf("\t\t-l lines\tlines to scroll every time\n");
+		printf("\t\t-r rate\t\tframes per second on output floods\n");
+		printf("\t\t-i\t\tuse io_uring instead of epoll\n");
+		printf("\t\t-j journal\tappend the scrolled lines to a file\n");
+		printf("\t\t-q\t\topen a socket for querying the buffer\n");
+		printf("\t\t-T\t\tsave the lines with their time\n");
+		printf("\t\t-a\t\tsave the lines with their colors\n");
 		printf("\t\t-u\t\tterminal is in unicode mode\n");
 		printf("\t\t-s\t\tterminal is not in unicode mode\n");
 		printf("\t\t-v\t\tenable the VT_FILENO enviroment variable\n");
 		printf("\t\t-c\t\tonly check whether it would run\n");
 		printf("\t\t-k\t\tset up the keys for the subsequent calls\n");
-		printf("\t\t-d level\tdebug level: 1=in/out 2=buffer\n");
+		printf("\t\t-d level\tdebug level: "
+			"1=in/out 2=buffer 8=stats\n");
 		printf("\t\t-h\t\tthis help\n");
 		exit(usage == 2 ? EXIT_FAILURE : EXIT_SUCCESS);
 	}
@@ -1142,6 +7671,7 @@ int main(int argn, char *argv[]) {
 	setlocale(LC_ALL, "");
 	if (singlechar == -1)
 		singlechar = MB_CUR_MAX == 1;
+	simdinit();
 
 					/* setup keys */
 
@@ -1197,6 +7727,11 @@ int main(int argn, char *argv[]) {
 			winsize.ws_row * winsize.ws_col);
 		exit(EXIT_FAILURE);
 	}
+	if (buffersize > MAXBUFFER) {
+		printf("buffer too large: %d, ", buffersize);
+		printf("should be at most %d\n", MAXBUFFER);
+		exit(EXIT_FAILURE);
+	}
 
 					/* number of lines to scroll */
 
@@ -1211,6 +7746,10 @@ int main(int argn, char *argv[]) {
 		printf("cannot parse lines: %s\n", linestring);
 		exit(EXIT_FAILURE);
 	}
+	if (framerate < 0) {
+		printf("negative frame rate: %d\n", framerate);
+		exit(EXIT_FAILURE);
+	}
 
 					/* scroll keys */
 